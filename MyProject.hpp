@@ -7,6 +7,7 @@
 #include <iostream>
 #include <stdexcept>
 #include <cstdlib>
+#include <cassert>
 #include <vector>
 #include <cstring>
 #include <optional>
@@ -14,7 +15,15 @@
 #include <cstdint>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
 #include <array>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <filesystem>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
@@ -24,6 +33,17 @@
 
 #include <chrono>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
@@ -82,6 +102,63 @@ struct Vertex {
 						
 		return attributeDescriptions;
 	}
+
+	// Position only stream of the depth prepass (GeometryBuffer::positionBuffer)
+	static VkVertexInputBindingDescription getPositionBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 0;
+		bindingDescription.stride = sizeof(glm::vec3);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+		return bindingDescription;
+	}
+
+	static VkVertexInputAttributeDescription getPositionAttributeDescription() {
+		VkVertexInputAttributeDescription attributeDescription{};
+		attributeDescription.binding = 0;
+		attributeDescription.location = 0;
+		attributeDescription.format = VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescription.offset = 0;
+
+		return attributeDescription;
+	}
+};
+
+// Per instance attributes of instanced draws, in vertex binding 1
+struct InstanceData {
+	glm::mat4 model;
+	uint32_t textureIndex;	// in BaseProject::textureTable
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 1;
+		bindingDescription.stride = sizeof(InstanceData);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+		
+		return bindingDescription;
+	}
+	
+	// the matrix takes one location per column, after the Vertex ones
+	static std::array<VkVertexInputAttributeDescription, 5>
+						getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 5>
+						attributeDescriptions{};
+		
+		for (uint32_t i = 0; i < 4; i++) {
+			attributeDescriptions[i].binding = 1;
+			attributeDescriptions[i].location = 3 + i;
+			attributeDescriptions[i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+			attributeDescriptions[i].offset =
+					offsetof(InstanceData, model) + i * sizeof(glm::vec4);
+		}
+
+		attributeDescriptions[4].binding = 1;
+		attributeDescriptions[4].location = 7;
+		attributeDescriptions[4].format = VK_FORMAT_R32_UINT;
+		attributeDescriptions[4].offset = offsetof(InstanceData, textureIndex);
+						
+		return attributeDescriptions;
+	}
 };
 
 
@@ -176,45 +253,498 @@ void PrintVkError( VkResult result ) {
 	std::cout << "Error: " << result << ", " << meaning << "\n";
 }
 
+// Hash of an OBJ corner, i.e. its (position, normal, texcoord) index triple,
+// used to share identical corners when building indexed meshes
+struct ObjIndexHash {
+	size_t operator()(const tinyobj::index_t &i) const {
+		size_t h = std::hash<int>()(i.vertex_index);
+		h = h * 31 + std::hash<int>()(i.normal_index);
+		h = h * 31 + std::hash<int>()(i.texcoord_index);
+		return h;
+	}
+};
+
+struct ObjIndexEqual {
+	bool operator()(const tinyobj::index_t &a, const tinyobj::index_t &b) const {
+		return a.vertex_index == b.vertex_index &&
+			   a.normal_index == b.normal_index &&
+			   a.texcoord_index == b.texcoord_index;
+	}
+};
+
+// Fixed set of worker threads. parallelFor runs fn(0..count-1) spread over
+// the workers and the calling thread, and returns when all of them are done.
+struct WorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::function<void(int)> job;
+	int jobCount = 0;
+	int nextJob = 0;
+	int running = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+	std::exception_ptr error;
+
+	void init(int threadCount);
+	void parallelFor(int count, const std::function<void(int)> &fn);
+	void runJobs(std::unique_lock<std::mutex> &lock);
+	void cleanup();
+};
+
 class BaseProject;
 
+// Sub-allocation strategies. Linear blocks only bump a pointer and are
+// reset when all their allocations are freed (load time resources);
+// free list blocks reuse freed ranges (resources with shorter lifetimes).
+enum AllocationStrategy {ALLOC_FREE_LIST, ALLOC_LINEAR};
+
+struct MemoryAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	char *mapped = nullptr;	// host visible blocks stay mapped
+	int pool = -1;
+	int block = -1;
+};
+
+struct MemoryRange {
+	VkDeviceSize offset;
+	VkDeviceSize size;
+};
+
+struct MemoryBlock {
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+	char *mapped;
+	VkDeviceSize top;						// linear strategy
+	std::vector<MemoryRange> freeRanges;	// free list, sorted by offset
+	std::set<VkDeviceSize> liveOffsets;		// of the allocations not freed yet
+	VkDeviceSize used;
+};
+
+// Blocks of one memory type, strategy and resource kind. Buffers and
+// images never share a block so bufferImageGranularity can be ignored.
+struct MemoryPool {
+	uint32_t memoryType;
+	AllocationStrategy strategy;
+	bool image;
+	std::vector<MemoryBlock> blocks;
+};
+
+struct MemoryAllocator {
+	BaseProject *BP;
+	VkDeviceSize blockSize;
+	VkPhysicalDeviceMemoryProperties memProperties;
+	std::vector<MemoryPool> pools;
+	
+	void init(BaseProject *bp, VkDeviceSize size);
+	MemoryAllocation allocate(const VkMemoryRequirements &memRequirements,
+							  VkMemoryPropertyFlags properties,
+							  AllocationStrategy strategy, bool image);
+	void free(MemoryAllocation &allocation);
+	void printStats();
+	void cleanup();
+
+	bool allocateFromBlock(MemoryBlock &block, AllocationStrategy strategy,
+						   VkDeviceSize size, VkDeviceSize alignment,
+						   VkDeviceSize &offset);
+	void createBlock(MemoryPool &pool, VkDeviceSize size);
+};
+
+// Read-only view of one shape's indexed mesh, owned by someone else
+// (a mapped MeshCache or the Loader)
+struct MeshView {
+	const char *name;
+	const Vertex *vertices;
+	uint32_t vertexCount;
+	const uint32_t *indices;
+	uint32_t indexCount;
+};
+
 struct Model {
 	BaseProject *BP;
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
-	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
-	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	// range of the model inside BaseProject::geometry
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0;
+	int32_t vertexOffset = 0;
+	// local space bounding box, computed at load
+	glm::vec3 bbMin = glm::vec3(0.0f);
+	glm::vec3 bbMax = glm::vec3(0.0f);
 	
 	void loadModel(std::string file);
-	void createIndexBuffer();
-	void createVertexBuffer();
+	void loadShape(const tinyobj::attrib_t &attrib, const tinyobj::shape_t &shape);
+	void loadView(const MeshView &view);
+	void computeBounds();
 
 	void init(BaseProject *bp, std::string file);
+	void initShared(BaseProject *bp, const Model &source);
 	void cleanup();
 };
 
-struct Texture {
+// View frustum as six inward facing planes (xyz normal, w distance),
+// extracted from a projection * view matrix
+struct Frustum {
+	glm::vec4 planes[6];
+
+	void extract(const glm::mat4 &viewProj);
+	bool intersects(const glm::vec3 &bbMin, const glm::vec3 &bbMax,
+					const glm::mat4 &transform) const;
+};
+
+// Draws collected while recording and sorted by a 64-bit key, so that
+// draws sharing a pipeline and a material are recorded together.
+// From the most significant bits: pipeline (4), material (16), mesh (20)
+// and depth (24), so equal state is drawn front to back.
+struct RenderQueue {
+	std::vector<uint64_t> keys;
+	std::vector<uint32_t> items;	// caller defined, e.g. an object index
+	std::vector<uint64_t> sortedKeys;
+	std::vector<uint32_t> sortedItems;
+
+	static uint64_t makeKey(uint32_t pipeline, uint32_t material, uint32_t mesh,
+							float depth, float maxDepth);
+	void clear();
+	void push(uint64_t key, uint32_t item);
+	void sort();
+};
+
+// All the models packed in one vertex and one index buffer. Models are
+// appended by add() while the scene is loaded and uploaded together by
+// build(), so a frame binds geometry only once.
+struct GeometryBuffer {
 	BaseProject *BP;
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	MemoryAllocation vertexBufferMemory;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	MemoryAllocation indexBufferMemory;
+	// positions only, built with BaseProject::depthPrepass
+	VkBuffer positionBuffer = VK_NULL_HANDLE;
+	MemoryAllocation positionBufferMemory;
+
+	void init(BaseProject *bp);
+	void add(Model &model);
+	void build();
+	void bind(VkCommandBuffer commandBuffer);
+	void bindPositions(VkCommandBuffer commandBuffer);
+	void cleanup();
+};
+
+// Binary mesh cache: a header, one MeshCacheShape entry per shape, one
+// MeshCacheMaterialFile per .mtl of the .obj and then the vertex and index
+// blobs. It is memory mapped when read back.
+const char MESH_CACHE_MAGIC[4] = {'D', 'G', 'M', 'C'};
+const uint32_t MESH_CACHE_VERSION = 3;
+
+struct MeshCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t sourceHash;	// hash of the .obj and of its .mtl files
+	uint64_t sourceStamp;	// their sizes and write times, checked first
+	uint32_t shapeCount;
+	uint32_t vertexSize;	// sizeof(Vertex) of the writer
+	uint32_t materialFileCount;
+};
+
+struct MeshCacheShape {
+	char name[64];
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint64_t vertexOffset;
+	uint64_t indexOffset;
+};
+
+// an mtllib of the .obj, resolved against its directory
+struct MeshCacheMaterialFile {
+	char path[256];
+};
+
+// Pipeline cache file: this header, then the data of vkGetPipelineCacheData.
+// It is used only on the device and driver that wrote it.
+const char PIPELINE_CACHE_MAGIC[4] = {'D', 'G', 'P', 'C'};
+const uint32_t PIPELINE_CACHE_VERSION = 1;
+
+struct PipelineCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+};
+
+// Cooked texture file (<image>.cache): this header, one TextureCacheLevel
+// per mip level and then the level blobs, 16 bytes aligned
+const char TEXTURE_CACHE_MAGIC[4] = {'D', 'G', 'T', 'X'};
+const uint32_t TEXTURE_CACHE_VERSION = 2;
+
+enum TextureCacheFormat {
+	TEXTURE_RGBA8,	// sRGB, 4 bytes per texel
+	TEXTURE_BC1,	// sRGB, opaque, 8 bytes per 4x4 block
+	TEXTURE_BC3		// sRGB with alpha, 16 bytes per 4x4 block
+};
+
+struct TextureCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t sourceHash;	// hash of the image file
+	uint64_t sourceStamp;	// its size and write time, checked first
+	uint32_t format;		// TextureCacheFormat
+	uint32_t width;
+	uint32_t height;
 	uint32_t mipLevels;
+};
+
+struct TextureCacheLevel {
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;	// from the first blob
+	uint64_t size;
+};
+
+struct MeshCache {
+	const char *data = nullptr;
+	size_t size = 0;
+	const MeshCacheHeader *header = nullptr;
+	const MeshCacheShape *shapes = nullptr;
+	const MeshCacheMaterialFile *materialFiles = nullptr;
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = nullptr;
+#endif
+
+	// the sources are hashed only when their stamp changed
+	bool open(const std::string &file, const std::string &objFile);
+	void close();
+	bool isOpen() const { return data != nullptr; }
+	MeshView view(int shape) const;
+
+	static bool write(const std::string &file, const std::string &objFile,
+					  const std::vector<std::string> &names,
+					  const std::vector<Model> &meshes);
+	static std::vector<std::string> mtllibs(const std::string &objFile);
+	static uint64_t hashFile(const std::string &file, uint64_t hash);
+	static uint64_t hashSources(const std::string &objFile, const std::vector<std::string> &mtls);
+	static uint64_t stampFile(const std::string &file, uint64_t stamp);
+	static uint64_t stampSources(const std::string &objFile, const std::vector<std::string> &mtls);
+	// overwrites the stamp of a cache file whose sources were touched but
+	// hash the same, so that they are not hashed again
+	static bool restamp(const std::string &file, size_t offset, uint64_t sourceStamp);
+};
+
+// A texture ready for upload: every mip level is precomputed, compressed to
+// BC1 (opaque) or BC3 when the device samples BC formats, RGBA8 otherwise.
+// load() cooks the image the first time and keeps the result in its cache.
+struct CookedTexture {
+	TextureCacheHeader header{};
+	std::vector<TextureCacheLevel> levels;
+	std::vector<char> data;	// the level blobs
+
+	void load(const std::string &source, bool compressed, uint32_t maxDimension);
+	bool read(const std::string &file, uint64_t sourceStamp, const std::string &source,
+			  bool compressed, uint32_t maxDimension);
+	void cook(const std::string &source, uint64_t sourceHash, bool compressed);
+	bool write(const std::string &file) const;
+	VkFormat vkFormat() const;
+
+	static uint32_t mipChainLength(uint32_t width, uint32_t height);
+	static uint64_t levelSize(uint32_t format, uint32_t width, uint32_t height);
+
+	static std::vector<uint8_t> downsample(const std::vector<uint8_t> &rgba,
+										   uint32_t width, uint32_t height);
+	static void compress(const uint8_t *rgba, uint32_t width, uint32_t height,
+						 bool alpha, uint8_t *out);
+	static void encodeColorBlock(const uint8_t *block, uint8_t *out);
+	static void encodeAlphaBlock(const uint8_t *block, uint8_t *out);
+};
+
+// Batches buffer uploads: data is copied into a persistently mapped staging
+// ring and the copies are recorded in a single command buffer, submitted
+// all at once by flush(). A full ring is flushed and reused.
+struct StagingUploader {
+	BaseProject *BP;
+	VkBuffer stagingBuffer;
+	MemoryAllocation stagingBufferMemory;
+	VkDeviceSize stagingSize;
+	VkDeviceSize stagingOffset;
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	VkFence fence;
+	// staging buffers for uploads larger than the ring, freed at flush
+	std::vector<VkBuffer> oversizeBuffers;
+	std::vector<MemoryAllocation> oversizeBuffersMemory;
+	int pendingCopies = 0;
+	bool submitted = false;	// waiting for the fence
+
+	void init(BaseProject *bp, VkDeviceSize size);
+	void upload(VkBuffer dst, const void *src, VkDeviceSize size);
+	// copies every region (offsets from src) and leaves the image ready to
+	// be sampled
+	void uploadImage(VkImage dst, const void *src, VkDeviceSize size,
+					 const std::vector<VkBufferImageCopy> &regions, uint32_t mipLevels);
+	void flush();
+	// flush() in two halves, for uploads that must not stall a frame
+	void submit();
+	bool finished();
+	void wait();
+	void cleanup();
+
+	VkBuffer stage(const void *src, VkDeviceSize size, VkDeviceSize &srcOffset);
+};
+
+// Sampler parameters, the key of SamplerCache
+struct SamplerState {
+	VkFilter filter = VK_FILTER_LINEAR;
+	VkSamplerAddressMode addressMode = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	float maxAnisotropy = 16.0f;
+
+	bool operator==(const SamplerState &other) const {
+		return filter == other.filter && addressMode == other.addressMode &&
+			   maxAnisotropy == other.maxAnisotropy;
+	}
+};
+
+// One VkSampler for each SamplerState. maxLod is not clamped, so a sampler
+// is shared by textures with any number of mip levels.
+struct SamplerCache {
+	BaseProject *BP;
+	std::vector<std::pair<SamplerState, VkSampler>> samplers;
+
+	void init(BaseProject *bp);
+	VkSampler get(const SamplerState &state);
+	void cleanup();
+};
+
+// The sampler belongs to BaseProject::samplers and is not destroyed here.
+// The pixels are uploaded through BaseProject::uploader: the texture can be
+// sampled after its next flush().
+// With BaseProject::streamTextures the image holds only the levels from
+// residentLevel down, BaseProject::streamer replaces it as requests change.
+struct Texture {
+	BaseProject *BP;
+	uint32_t mipLevels;		// levels in the image
+	VkFormat format;
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	MemoryAllocation textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
+
+	uint32_t bindlessIndex = 0;	// slot in BaseProject::textureTable
+
+	// streaming only
+	CookedTexture cooked;		// every level, the source of the new images
+	uint32_t residentLevel = 0;	// cooked level in the first image level
+	uint32_t wantedLevel = 0;	// finest level requested since the last update
 	
-	void createTextureImage(std::string file);
+	void createTextureImage(const CookedTexture &cooked);
+	void createLevels(const CookedTexture &cooked, uint32_t firstLevel,
+					  StagingUploader &uploader, VkImage &image,
+					  MemoryAllocation &memory);
 	void createTextureImageView();
-	void createTextureSampler();
+	void request(float pixels);
 
-	void init(BaseProject *bp, std::string file);
+	void init(BaseProject *bp, std::string file, const SamplerState &sampler = {});
+	void init(BaseProject *bp, const CookedTexture &cooked,
+			  const SamplerState &sampler = {});
+	void cleanup();
+};
+
+// Textures shared by path and sampler state: acquire() loads a file the
+// first time and counts the users, release() destroys it after the last one.
+// Acquiring a list loads the new files on BaseProject::workers.
+struct TextureCache {
+	struct Entry {
+		Texture texture;
+		int users = 0;
+	};
+
+	BaseProject *BP;
+	std::unordered_map<std::string, Entry> entries;
+
+	void init(BaseProject *bp);
+	Texture *acquire(const std::string &file, const SamplerState &sampler = {});
+	std::vector<Texture *> acquire(const std::vector<std::string> &files,
+								   const SamplerState &sampler = {});
+	void release(Texture *texture);
+	void cleanup();
+
+	static std::string key(const std::string &file, const SamplerState &sampler);
+};
+
+// Mip level residency of the textures under BaseProject::textureBudget.
+// Each update() swaps in the images of the last batch once its upload is
+// done, then starts a new batch: textures requested finer than resident
+// first, making room by dropping the levels of textures finer than they
+// were requested. The sets of a swapped texture are rewritten by refresh()
+// when their swap chain image is no longer in flight, and its old image is
+// retired until no frame can use it.
+struct TextureStreamer {
+	struct Binding {
+		Texture *texture;
+		uint32_t image;		// swap chain image of the set
+		VkDescriptorSet set;
+		uint32_t binding;
+		uint32_t element;	// in an array binding
+		bool stale = false;	// still points to a swapped out image
+	};
+	// new image of a texture, swapped in when its upload is done
+	struct Change {
+		Texture *texture;
+		uint32_t level;
+		VkImage image;
+		MemoryAllocation memory;
+		VkImageView view;
+	};
+	// swapped out image, destroyed once the sets no longer point to it
+	// and the frames that did are done
+	struct Retired {
+		Texture *texture;
+		VkImage image;
+		MemoryAllocation memory;
+		VkImageView view;
+		int frames;
+	};
+
+	BaseProject *BP;
+	StagingUploader uploader;
+	std::vector<Texture *> textures;
+	std::vector<Binding> bindings;
+	std::vector<Change> changes;
+	std::vector<Retired> retired;
+	VkDeviceSize residentSize = 0;
+	size_t maxChanges = 4;	// textures in a batch
+
+	void init(BaseProject *bp);
+	void add(Texture *texture);
+	void remove(Texture *texture);
+	void bind(Texture *texture, uint32_t image, VkDescriptorSet set,
+			  uint32_t binding, uint32_t element = 0);
+	void unbind(VkDescriptorSet set);
+	void update();
+	bool refresh(uint32_t image);
 	void cleanup();
+
+	void schedule();
+	void start(Texture *texture, uint32_t level);
+	void apply();
+	void retire();
+	void destroy(Change &change);
+	void destroy(Retired &old);
+	bool changing(Texture *texture) const;
+	bool stale(Texture *texture) const;
+	static VkDeviceSize levelsSize(const Texture *texture, uint32_t level);
 };
 
 struct DescriptorSetLayoutBinding {
 	uint32_t binding;
 	VkDescriptorType type;
 	VkShaderStageFlags flags;
+	uint32_t count = 1;	// more than one: a partially bound array (descriptor indexing)
 };
 
 
@@ -226,32 +756,116 @@ struct DescriptorSetLayout {
 	void cleanup();
 };
 
+struct ComputePipeline {
+	BaseProject *BP;
+	VkPipeline computePipeline;
+	VkPipelineLayout pipelineLayout;
+
+	void init(BaseProject *bp, const std::string& ComputeShader,
+			  std::vector<DescriptorSetLayout *> D,
+			  std::vector<VkPushConstantRange> PC = {});
+	void cleanup();
+};
+
+// Where a graphics pipeline draws. With BaseProject::depthPrepass the render
+// pass has a depth only subpass before the color one.
+enum PipelinePass {
+	COLOR_PASS,				// depth test LESS (LESS_OR_EQUAL after a prepass) and write
+	COLOR_PASS_PREPASSED,	// drawn in the prepass too: depth EQUAL, no writes
+	DEPTH_PREPASS			// positions only, no fragment shader
+};
+
 struct Pipeline {
 	BaseProject *BP;
 	VkPipeline graphicsPipeline;
   	VkPipelineLayout pipelineLayout;
   	
   	void init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-  			  std::vector<DescriptorSetLayout *> D);
+  			  std::vector<DescriptorSetLayout *> D,
+  			  std::vector<VkPushConstantRange> PC = {},
+  			  bool instanced = false,
+  			  PipelinePass pass = COLOR_PASS,
+  			  std::vector<uint32_t> specialization = {});
   	VkShaderModule createShaderModule(const std::vector<char>& code);
   	static std::vector<char> readFile(const std::string& filename);  	
 	void cleanup();
 };
 
-enum DescriptorSetElementType {UNIFORM, TEXTURE};
+// Material features compiled into the shaders: bit i is the value of the
+// specialization constant with constant_id = i
+enum MaterialFeature {
+	MATERIAL_SPECULAR = 1 << 0,
+	MATERIAL_FEATURE_COUNT = 1
+};
+
+// The pipelines built from the same shaders for each combination of
+// material feature bits. A variant is created the first time it is asked
+// for: ask for all of them at load, get() must not create pipelines while
+// command buffers are recorded in parallel.
+struct PipelineVariants {
+	BaseProject *BP;
+	std::string vertShader;
+	std::string fragShader;
+	std::vector<DescriptorSetLayout *> D;
+	std::vector<VkPushConstantRange> PC;
+	bool instanced;
+	PipelinePass pass;
+	std::unordered_map<uint32_t, Pipeline> variants;
+
+	void init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
+			  std::vector<DescriptorSetLayout *> D,
+			  std::vector<VkPushConstantRange> PC = {},
+			  bool instanced = false,
+			  PipelinePass pass = COLOR_PASS);
+	Pipeline &get(uint32_t features);
+	void cleanup();
+};
+
+// Uniform blocks of many objects in one buffer, with a region for each
+// swap chain image. Each object owns a slot and its data is selected with
+// a dynamic offset when the descriptor set is bound. Slots are written to
+// a CPU copy and sent to an image's region all at once or one by one.
+struct DynamicUniformBuffer {
+	BaseProject *BP;
+	VkBuffer buffer;
+	MemoryAllocation bufferMemory;
+	VkDeviceSize elementSize;
+	VkDeviceSize stride;	// elementSize aligned to minUniformBufferOffsetAlignment
+	uint32_t capacity;
+	uint32_t count = 0;
+	std::vector<char> shadow;
+
+	void init(BaseProject *bp, VkDeviceSize size, uint32_t maxElements);
+	uint32_t allocate();
+	void *slot(uint32_t i) { return shadow.data() + i * stride; }
+	uint32_t offset(int currentImage, uint32_t i) const {
+		return static_cast<uint32_t>((currentImage * capacity + i) * stride);
+	}
+	void upload(int currentImage);
+	void upload(int currentImage, uint32_t i);
+	void cleanup();
+};
+
+enum DescriptorSetElementType {UNIFORM, TEXTURE, DYNAMIC_UNIFORM, STORAGE};
 
+// UNIFORM and STORAGE elements get a host visible buffer of size bytes per
+// swap chain image, unless buffers gives existing ones (one per image).
 struct DescriptorSetElement {
 	int binding;
 	DescriptorSetElementType type;
 	int size;
 	Texture *tex;
+	DynamicUniformBuffer *dynamic = nullptr;
+	const std::vector<VkBuffer> *buffers = nullptr;
 };
 
 struct DescriptorSet {
 	BaseProject *BP;
 
 	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
+	std::vector<std::vector<MemoryAllocation>> uniformBuffersMemory;
+	// host pointers to the uniform buffers, mapped for the whole lifetime
+	std::vector<std::vector<void *>> uniformBuffersMapped;
 	std::vector<VkDescriptorSet> descriptorSets;
 	
 	std::vector<bool> toFree;
@@ -259,8 +873,30 @@ struct DescriptorSet {
 	void init(BaseProject *bp, DescriptorSetLayout *L,
 		std::vector<DescriptorSetElement> E);
 	void cleanup();
+
+	// Write pointer to the uniform buffer of element j for a swap chain image
+	void *uniformData(int j, int currentImage) {
+		return uniformBuffersMapped[j][currentImage];
+	}
 };
 
+// Every texture in one partially bound array (BaseProject::bindlessTextures).
+// Shaders index it with Texture::bindlessIndex, so the objects need no
+// texture set of their own. Textures are added at load, while no frame uses
+// the sets; the slots of released ones are reused. One set per swap chain
+// image, so the streamer can rewrite those of the images not in flight.
+struct TextureTable {
+	BaseProject *BP;
+	DescriptorSetLayout DSL;	// binding 0: the array, fragment stage
+	VkDescriptorPool descriptorPool;
+	std::vector<VkDescriptorSet> descriptorSets;
+	std::vector<Texture *> slots;	// nullptr: free
+
+	void init(BaseProject *bp, uint32_t capacity);
+	uint32_t add(Texture *texture);
+	void remove(Texture *texture);
+	void cleanup();
+};
 
 // MAIN ! 
 class BaseProject {
@@ -269,6 +905,15 @@ class BaseProject {
 	friend class Pipeline;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
+	friend class StagingUploader;
+	friend class MemoryAllocator;
+	friend class GeometryBuffer;
+	friend class DynamicUniformBuffer;
+	friend class ComputePipeline;
+	friend class SamplerCache;
+	friend class TextureCache;
+	friend class TextureStreamer;
+	friend class TextureTable;
 public:
 	virtual void setWindowParameters() = 0;
     void run() {
@@ -287,6 +932,8 @@ protected:
 	int uniformBlocksInPool;
 	int texturesInPool;
 	int setsInPool;
+	int dynamicUniformBlocksInPool = 0;
+	int storageBuffersInPool = 0;
 
 	// Lesson 12
     GLFWwindow* window;
@@ -300,6 +947,43 @@ protected:
     VkQueue presentQueue;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
+	// optional device features and extensions
+	bool multiDrawIndirectSupported = false;
+	bool drawIndirectFirstInstanceSupported = false;
+	bool drawIndirectCountSupported = false;
+	bool textureCompressionBCSupported = false;
+	uint32_t maxImageDimension2D = 4096;	// cooked textures larger than this are rejected
+	PFN_vkCmdDrawIndexedIndirectCountKHR cmdDrawIndexedIndirectCount = nullptr;
+	// Record the draws again every frame instead of once at init, so that
+	// populateCommandBuffer can change them (e.g. to cull objects).
+	// Each frame in flight has its own pool, reset before recording.
+	bool recordEveryFrame = false;
+	std::vector<VkCommandPool> frameCommandPools;
+	std::vector<VkCommandBuffer> frameCommandBuffers;
+	// With recordEveryFrame, split the draws in parts recorded on the
+	// workers into secondary command buffers, one pool for each part of
+	// each frame in flight (indexed frame * recordParts + part)
+	bool recordInParallel = false;
+	int recordParts = 0;
+	std::vector<VkCommandPool> secondaryCommandPools;
+	std::vector<VkCommandBuffer> secondaryCommandBuffers;
+	// Split the render pass in a depth only subpass, recorded by
+	// populateDepthPrepass, and the color subpass. Set it in
+	// setWindowParameters, createRenderPass reads it.
+	bool depthPrepass = false;
+	// Keep only the texture levels requested with Texture::request, within
+	// textureBudget bytes; textures start at the finest level no larger
+	// than streamInitialSize. Set them in setWindowParameters.
+	bool streamTextures = false;
+	VkDeviceSize textureBudget = 64 * 1024 * 1024;
+	uint32_t streamInitialSize = 64;
+	TextureStreamer streamer;
+	// Put every texture in textureTable, up to bindlessCapacity of them.
+	// Set it in setWindowParameters; it is cleared when the device lacks
+	// descriptor indexing.
+	bool bindlessTextures = false;
+	uint32_t bindlessCapacity = 64;
+	TextureTable textureTable;
 
     // Lesson 14
     VkSwapchainKHR swapChain;
@@ -310,6 +994,10 @@ protected:
 	
 	// Lesson 19
 	VkRenderPass renderPass;
+
+	// Shared by all the pipelines, loaded from and saved to pipelineCacheFile
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+	std::string pipelineCacheFile = "pipeline_cache.bin";
 	
  	VkDescriptorPool descriptorPool;
 
@@ -319,7 +1007,7 @@ protected:
 	
 	// L22.1 --- depth buffer allocation (Z-buffer)
 	VkImage depthImage;
-	VkDeviceMemory depthImageMemory;
+	MemoryAllocation depthImageMemory;
 	VkImageView depthImageView;
 
 	// L22.2 --- Frame buffers
@@ -332,6 +1020,19 @@ protected:
 	std::vector<VkFence> inFlightFences;
 	std::vector<VkFence> imagesInFlight;
 	
+	// Sub-allocates all buffer and image memory
+	MemoryAllocator allocator;
+
+	// Worker threads for load time jobs
+	WorkerPool workers;
+	
+	// Uploads to device local memory, flushed once after localInit
+	StagingUploader uploader;
+	GeometryBuffer geometry;
+
+	SamplerCache samplers;
+	TextureCache textures;
+	
 	glm::vec3 CamAng = glm::vec3(0.0f, glm::radians(-90.0f), 0.0f);
 	glm::vec3 CamPos = glm::vec3(0.0f, 0.5f, 0.0f);
 	glm::vec3 CamDir = glm::vec3(0.0f, 0.0f, 1.0f);
@@ -355,6 +1056,8 @@ protected:
 		createSurface();				// L13
 		pickPhysicalDevice();			// L14
 		createLogicalDevice();			// L14
+		createPipelineCache();
+		allocator.init(this, 64 * 1024 * 1024);
 		createSwapChain();				// L15
 		createImageViews();				// L15
 		createRenderPass();				// L19
@@ -363,12 +1066,102 @@ protected:
 		createFramebuffers();			// L22.2
 		createDescriptorPool();			// L21
 
+		workers.init(std::max(1u, std::thread::hardware_concurrency()) - 1);
+		uploader.init(this, 16 * 1024 * 1024);
+		geometry.init(this);
+		samplers.init(this);
+		if (bindlessTextures) {
+			textureTable.init(this, bindlessCapacity);
+		}
+		textures.init(this);
+		if (streamTextures) {
+			streamer.init(this);
+		}
+
 		localInit();
+		geometry.build();
+		uploader.flush();
+		allocator.printStats();
 
 		createCommandBuffers();			// L22.5 (13)
 		createSyncObjects();			// L22.3 
     }
 
+	// Seeds the cache with pipelineCacheFile when it was written by this
+	// device and driver, otherwise starts empty
+	void createPipelineCache() {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+		std::vector<char> data;
+		std::ifstream in(pipelineCacheFile, std::ios::ate | std::ios::binary);
+		uint64_t size = in.is_open() ? (uint64_t) in.tellg() : 0;
+		in.seekg(0);
+		PipelineCacheHeader header{};
+		// dataSize is checked against the file before anything is allocated
+		if (size >= sizeof(header) && in.read((char *) &header, sizeof(header)) &&
+			header.dataSize <= size - sizeof(header) &&
+			memcmp(header.magic, PIPELINE_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+			header.version == PIPELINE_CACHE_VERSION &&
+			header.vendorID == properties.vendorID &&
+			header.deviceID == properties.deviceID &&
+			header.driverVersion == properties.driverVersion &&
+			memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0) {
+			data.resize(header.dataSize);
+			if (!in.read(data.data(), data.size())) {
+				data.clear();
+			}
+		}
+		std::cout << "Pipeline cache: " << data.size() << " bytes loaded\n";
+
+		VkPipelineCacheCreateInfo cacheInfo{};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		cacheInfo.initialDataSize = data.size();
+		cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+		VkResult result = vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache);
+		if (result != VK_SUCCESS && !data.empty()) {
+			// the driver rejected the data: start over with an empty cache
+			cacheInfo.initialDataSize = 0;
+			cacheInfo.pInitialData = nullptr;
+			result = vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache);
+		}
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create pipeline cache!");
+		}
+	}
+
+	// Writes the cache back, a failure only costs the next warm start
+	void savePipelineCache() {
+		size_t size = 0;
+		if (vkGetPipelineCacheData(device, pipelineCache, &size, nullptr) != VK_SUCCESS) {
+			return;
+		}
+		std::vector<char> data(size);
+		if (vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS) {
+			return;
+		}
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		PipelineCacheHeader header{};
+		memcpy(header.magic, PIPELINE_CACHE_MAGIC, sizeof(header.magic));
+		header.version = PIPELINE_CACHE_VERSION;
+		header.vendorID = properties.vendorID;
+		header.deviceID = properties.deviceID;
+		header.driverVersion = properties.driverVersion;
+		memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+		header.dataSize = size;
+
+		std::ofstream out(pipelineCacheFile, std::ios::binary | std::ios::trunc);
+		out.write((const char *) &header, sizeof(header));
+		out.write(data.data(), size);
+		if (!out.good()) {
+			std::cout << "Could not write " << pipelineCacheFile << "\n";
+		}
+	}
+
 	// Lesson 12 and 22.0
     void createInstance() {
     	VkApplicationInfo appInfo{};
@@ -377,7 +1170,23 @@ protected:
     	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     	appInfo.pEngineName = "No Engine";
     	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
+		// 1.1 only for vkGetPhysicalDeviceFeatures2 (descriptor indexing),
+		// a 1.0 loader rejects it
 		appInfo.apiVersion = VK_API_VERSION_1_0;
+		if (bindlessTextures) {
+			uint32_t loaderVersion = VK_API_VERSION_1_0;
+			auto enumerateInstanceVersion = (PFN_vkEnumerateInstanceVersion)
+					vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion");
+			if (enumerateInstanceVersion != nullptr) {
+				enumerateInstanceVersion(&loaderVersion);
+			}
+			if (loaderVersion >= VK_API_VERSION_1_1) {
+				appInfo.apiVersion = VK_API_VERSION_1_1;
+			} else {
+				std::cout << "Vulkan 1.1 not available, no bindless textures" << std::endl;
+				bindlessTextures = false;
+			}
+		}
 		
 		VkInstanceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -658,6 +1467,56 @@ protected:
 		
 		VkPhysicalDeviceFeatures deviceFeatures{};
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
+
+		// optional features for indirect drawing
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+		deviceFeatures.drawIndirectFirstInstance =
+				supportedFeatures.drawIndirectFirstInstance;
+		multiDrawIndirectSupported = supportedFeatures.multiDrawIndirect == VK_TRUE;
+		// cooked textures are compressed only when BC formats are supported
+		deviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+		textureCompressionBCSupported =
+				supportedFeatures.textureCompressionBC == VK_TRUE;
+		drawIndirectFirstInstanceSupported =
+				supportedFeatures.drawIndirectFirstInstance == VK_TRUE;
+		VkPhysicalDeviceProperties deviceProperties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+		maxImageDimension2D = deviceProperties.limits.maxImageDimension2D;
+
+		// bindless textures index a sampler array with per object values
+		VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+		indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+		if (bindlessTextures) {
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+			VkPhysicalDeviceDescriptorIndexingFeaturesEXT supportedIndexing{};
+			supportedIndexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+			if (properties.apiVersion >= VK_API_VERSION_1_1 &&
+				checkDeviceExtension(physicalDevice, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)) {
+				VkPhysicalDeviceFeatures2 features2{};
+				features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+				features2.pNext = &supportedIndexing;
+				vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+			}
+			bindlessTextures = supportedIndexing.shaderSampledImageArrayNonUniformIndexing &&
+							   supportedIndexing.descriptorBindingPartiallyBound &&
+							   supportedIndexing.runtimeDescriptorArray;
+			indexingFeatures.shaderSampledImageArrayNonUniformIndexing = bindlessTextures;
+			indexingFeatures.descriptorBindingPartiallyBound = bindlessTextures;
+			indexingFeatures.runtimeDescriptorArray = bindlessTextures;
+		}
+
+		std::vector<const char*> extensions = deviceExtensions;
+		if (bindlessTextures) {
+			extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+		}
+		drawIndirectCountSupported =
+				checkDeviceExtension(physicalDevice, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+		if (drawIndirectCountSupported) {
+			extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+		}
 		
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -667,9 +1526,10 @@ protected:
 			static_cast<uint32_t>(queueCreateInfos.size());
 		
 		createInfo.pEnabledFeatures = &deviceFeatures;
+		createInfo.pNext = bindlessTextures ? &indexingFeatures : nullptr;
 		createInfo.enabledExtensionCount =
-				static_cast<uint32_t>(deviceExtensions.size());
-		createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+				static_cast<uint32_t>(extensions.size());
+		createInfo.ppEnabledExtensionNames = extensions.data();
 
 			createInfo.enabledLayerCount = 
 					static_cast<uint32_t>(validationLayers.size());
@@ -684,6 +1544,45 @@ protected:
 		
 		vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+
+		if (drawIndirectCountSupported) {
+			cmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)
+					vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+			drawIndirectCountSupported = cmdDrawIndexedIndirectCount != nullptr;
+		}
+	}
+
+	bool checkDeviceExtension(VkPhysicalDevice device, const char *name) {
+		uint32_t extensionCount;
+		vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount,
+											 availableExtensions.data());
+		for (const auto &extension : availableExtensions) {
+			if (strcmp(extension.extensionName, name) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Draws up to maxDrawCount commands of buffer, stride apart, of which
+	// the first *countBuffer are valid. Without VK_KHR_draw_indirect_count
+	// all maxDrawCount are drawn: the unused ones must have instanceCount 0.
+	void drawIndexedIndirect(VkCommandBuffer commandBuffer, VkBuffer buffer,
+							 VkDeviceSize offset, VkBuffer countBuffer,
+							 VkDeviceSize countOffset, uint32_t maxDrawCount,
+							 uint32_t stride) {
+		if (drawIndirectCountSupported) {
+			cmdDrawIndexedIndirectCount(commandBuffer, buffer, offset, countBuffer,
+										countOffset, maxDrawCount, stride);
+		} else if (multiDrawIndirectSupported) {
+			vkCmdDrawIndexedIndirect(commandBuffer, buffer, offset, maxDrawCount, stride);
+		} else {
+			for (uint32_t i = 0; i < maxDrawCount; i++) {
+				vkCmdDrawIndexedIndirect(commandBuffer, buffer, offset + i * stride, 1, stride);
+			}
+		}
 	}
 	
 	// Lesson 14
@@ -870,12 +1769,37 @@ protected:
 		
 		VkSubpassDependency dependency{};
 		dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-		dependency.dstSubpass = 0;
+		dependency.dstSubpass = colorSubpass();
 		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 		dependency.srcAccessMask = 0;
 		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+		std::vector<VkSubpassDescription> subpasses;
+		std::vector<VkSubpassDependency> dependencies;
+		if (depthPrepass) {
+			// subpass 0 only writes depth, the color subpass tests against it
+			VkSubpassDescription prepass{};
+			prepass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+			prepass.colorAttachmentCount = 0;
+			prepass.pDepthStencilAttachment = &depthAttachmentRef;
+			subpasses.push_back(prepass);
+
+			VkSubpassDependency prepassDependency{};
+			prepassDependency.srcSubpass = 0;
+			prepassDependency.dstSubpass = 1;
+			prepassDependency.srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+			prepassDependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+			prepassDependency.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+											 VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+			prepassDependency.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+											  VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+			prepassDependency.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+			dependencies.push_back(prepassDependency);
+		}
+		subpasses.push_back(subpass);
+		dependencies.push_back(dependency);
+
 		std::array<VkAttachmentDescription, 2> attachments =
 								{colorAttachment, depthAttachment};
 
@@ -883,10 +1807,10 @@ protected:
 		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
 		renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());;
 		renderPassInfo.pAttachments = attachments.data();
-		renderPassInfo.subpassCount = 1;
-		renderPassInfo.pSubpasses = &subpass;
-		renderPassInfo.dependencyCount = 1;
-		renderPassInfo.pDependencies = &dependency;
+		renderPassInfo.subpassCount = static_cast<uint32_t>(subpasses.size());
+		renderPassInfo.pSubpasses = subpasses.data();
+		renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+		renderPassInfo.pDependencies = dependencies.data();
 
 		VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr,
 					&renderPass);
@@ -961,7 +1885,8 @@ protected:
 					 VkFormat format,
 				 	 VkImageTiling tiling, VkImageUsageFlags usage,
 				 	 VkMemoryPropertyFlags properties, VkImage& image,
-				 	 VkDeviceMemory& imageMemory) {		
+				 	 MemoryAllocation& imageMemory,
+				 	 AllocationStrategy strategy = ALLOC_FREE_LIST) {		
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -987,23 +1912,26 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-											properties);
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-								VK_SUCCESS) {
-			throw std::runtime_error("failed to allocate image memory!");
-		}
+		imageMemory = allocator.allocate(memRequirements, properties,
+										 strategy, true);
 
-		vkBindImageMemory(device, image, imageMemory, 0);
+		vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 	}
 
 	// New - Lesson 23
 	void generateMipmaps(VkImage image, VkFormat imageFormat,
 						 int32_t texWidth, int32_t texHeight,
 						 uint32_t mipLevels) {
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+		recordMipmaps(commandBuffer, image, imageFormat,
+					  texWidth, texHeight, mipLevels);
+		endSingleTimeCommands(commandBuffer);
+	}
+
+	// Level 0 in TRANSFER_DST_OPTIMAL, every level ends in SHADER_READ_ONLY_OPTIMAL
+	void recordMipmaps(VkCommandBuffer commandBuffer, VkImage image,
+					   VkFormat imageFormat, int32_t texWidth, int32_t texHeight,
+					   uint32_t mipLevels) {
 		VkFormatProperties formatProperties;
 		vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat,
 							&formatProperties);
@@ -1013,8 +1941,6 @@ protected:
 			throw std::runtime_error("texture image format does not support linear blitting!");
 		}
 
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-		
 		VkImageMemoryBarrier barrier{};
 		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 		barrier.image = image;
@@ -1085,8 +2011,6 @@ protected:
 							 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
 							 0, nullptr, 0, nullptr,
 							 1, &barrier);
-
-		endSingleTimeCommands(commandBuffer);
 	}
 	
 	// New - Lesson 23
@@ -1183,7 +2107,8 @@ protected:
 	// Lesson 21
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 					  VkMemoryPropertyFlags properties,
-					  VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+					  VkBuffer& buffer, MemoryAllocation& bufferMemory,
+					  AllocationStrategy strategy = ALLOC_FREE_LIST) {
 		VkBufferCreateInfo bufferInfo{};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.size = size;
@@ -1200,20 +2125,10 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 		
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex =
-				findMemoryType(memRequirements.memoryTypeBits, properties);
-
-		result = vkAllocateMemory(device, &allocInfo, nullptr,
-				&bufferMemory);
-		if (result != VK_SUCCESS) {
-		 	PrintVkError(result);
-			throw std::runtime_error("failed to allocate vertex buffer memory!");
-		}
+		bufferMemory = allocator.allocate(memRequirements, properties,
+										  strategy, false);
 		
-		vkBindBufferMemory(device, buffer, bufferMemory, 0);	
+		vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);	
 	}
 	
 	// Lesson 21
@@ -1235,7 +2150,7 @@ protected:
     
     // Lesson 21
 	void createDescriptorPool() {
-		std::array<VkDescriptorPoolSize, 2> poolSizes{};
+		std::vector<VkDescriptorPoolSize> poolSizes(2);
 		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 		poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
 															 swapChainImages.size());
@@ -1244,6 +2159,20 @@ protected:
 		poolSizes[1].descriptorCount = static_cast<uint32_t>(texturesInPool *
 															 swapChainImages.size());
 		//
+		if (dynamicUniformBlocksInPool > 0) {
+			VkDescriptorPoolSize dynamicSize{};
+			dynamicSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			dynamicSize.descriptorCount = static_cast<uint32_t>(dynamicUniformBlocksInPool *
+																 swapChainImages.size());
+			poolSizes.push_back(dynamicSize);
+		}
+		if (storageBuffersInPool > 0) {
+			VkDescriptorPoolSize storageSize{};
+			storageSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			storageSize.descriptorCount = static_cast<uint32_t>(storageBuffersInPool *
+																swapChainImages.size());
+			poolSizes.push_back(storageSize);
+		}
 
 		VkDescriptorPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1259,10 +2188,38 @@ protected:
 		}
 	}
 	
+	// Commands recorded before the render pass begins (e.g. compute work)
+	virtual void populateComputeCommands(VkCommandBuffer commandBuffer, int i) {
+	}
+
 	virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
 
+	// Draws of the depth prepass, recorded inline before the color subpass
+	virtual void populateDepthPrepass(VkCommandBuffer commandBuffer, int i) {
+	}
+
+	// Index of the subpass where populateCommandBuffer draws
+	uint32_t colorSubpass() const {
+		return depthPrepass ? 1 : 0;
+	}
+
+	// Records one of partCount parts of the draws into a secondary command
+	// buffer. Called concurrently for different parts: it must only read
+	// shared state. By default part 0 records everything.
+	virtual void populateCommandBufferPart(VkCommandBuffer commandBuffer, int i,
+										   int part, int partCount) {
+		if (part == 0) {
+			populateCommandBuffer(commandBuffer, i);
+		}
+	}
+
 	// Lesson 22.5 (and 13)
     void createCommandBuffers() {
+		if (recordEveryFrame) {
+			createFrameCommandBuffers();
+			return;
+		}
+
     	// Lesson 13
     	commandBuffers.resize(swapChainFramebuffers.size());
     	
@@ -1279,56 +2236,206 @@ protected:
 			throw std::runtime_error("failed to allocate command buffers!");
 		}
 		
-		// Lesson 22.5 --- Draw calls
-		// This is where the commands that actually draw something on screen are!
 		for (size_t i = 0; i < commandBuffers.size(); i++) {
-			VkCommandBufferBeginInfo beginInfo{};
-			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-			beginInfo.flags = 0; // Optional
-			beginInfo.pInheritanceInfo = nullptr; // Optional
+			recordCommandBuffer(commandBuffers[i], i, 0);
+		}
+	}
 
-			if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-						VK_SUCCESS) {
-				throw std::runtime_error("failed to begin recording command buffer!");
-			}
-			
-			VkRenderPassBeginInfo renderPassInfo{};
-			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassInfo.renderPass = renderPass; 
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
-			renderPassInfo.renderArea.offset = {0, 0};
-			renderPassInfo.renderArea.extent = swapChainExtent;
-	
-			std::array<VkClearValue, 2> clearValues{};
-			clearValues[0].color = initialBackgroundColor;
-			clearValues[1].depthStencil = {1.0f, 0};
-	
-			renderPassInfo.clearValueCount =
-							static_cast<uint32_t>(clearValues.size());
-			renderPassInfo.pClearValues = clearValues.data();
-			
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-					VK_SUBPASS_CONTENTS_INLINE);			
-	
+	// Records again the command buffer of a swap chain image whose
+	// descriptor sets were rewritten
+	void recreateCommandBuffer(uint32_t imageIndex) {
+		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffers[imageIndex]);
 
-			populateCommandBuffer(commandBuffers[i], i);
-			
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = commandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+
+		VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
+				&commandBuffers[imageIndex]);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to allocate command buffer!");
+		}
+		recordCommandBuffer(commandBuffers[imageIndex], imageIndex, 0);
+	}
+
+	// One transient pool and command buffer per frame in flight
+	void createFrameCommandBuffers() {
+		QueueFamilyIndices queueFamilyIndices = 
+				findQueueFamilies(physicalDevice);
+
+		frameCommandPools.resize(MAX_FRAMES_IN_FLIGHT);
+		frameCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+
+		for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+			VkCommandPoolCreateInfo poolInfo{};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+			VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr,
+												  &frameCommandPools[i]);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to create frame command pool!");
+			}
+
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = frameCommandPools[i];
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			allocInfo.commandBufferCount = 1;
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-				throw std::runtime_error("failed to record command buffer!");
+			result = vkAllocateCommandBuffers(device, &allocInfo,
+											  &frameCommandBuffers[i]);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to allocate frame command buffer!");
 			}
 		}
+
+		if (recordInParallel) {
+			createSecondaryCommandBuffers();
+		}
 	}
-    
-    // Lesson 22.5
-    void createSyncObjects() {
-    	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-    	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
-    	    	
+
+	// One part for each worker thread plus the main thread
+	void createSecondaryCommandBuffers() {
+		QueueFamilyIndices queueFamilyIndices = 
+				findQueueFamilies(physicalDevice);
+
+		recordParts = static_cast<int>(workers.threads.size()) + 1;
+		secondaryCommandPools.resize(MAX_FRAMES_IN_FLIGHT * recordParts);
+		secondaryCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT * recordParts);
+
+		for (size_t i = 0; i < secondaryCommandPools.size(); i++) {
+			VkCommandPoolCreateInfo poolInfo{};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+			VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr,
+												  &secondaryCommandPools[i]);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to create secondary command pool!");
+			}
+
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = secondaryCommandPools[i];
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+			allocInfo.commandBufferCount = 1;
+
+			result = vkAllocateCommandBuffers(device, &allocInfo,
+											  &secondaryCommandBuffers[i]);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to allocate secondary command buffer!");
+			}
+		}
+	}
+
+	// Records the parts of a frame on the workers, then runs them all from
+	// the render pass of the primary command buffer
+	void recordSecondaryCommandBuffers(VkCommandBuffer commandBuffer, int imageIndex) {
+		VkCommandBuffer *secondaries = &secondaryCommandBuffers[currentFrame * recordParts];
+
+		workers.parallelFor(recordParts, [&](int part) {
+			vkResetCommandPool(device, secondaryCommandPools[currentFrame * recordParts + part], 0);
+
+			VkCommandBufferInheritanceInfo inheritanceInfo{};
+			inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+			inheritanceInfo.renderPass = renderPass;
+			inheritanceInfo.subpass = colorSubpass();
+			inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex];
+
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+							  VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+			beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+			if (vkBeginCommandBuffer(secondaries[part], &beginInfo) != VK_SUCCESS) {
+				throw std::runtime_error("failed to begin recording secondary command buffer!");
+			}
+
+			populateCommandBufferPart(secondaries[part], imageIndex, part, recordParts);
+
+			if (vkEndCommandBuffer(secondaries[part]) != VK_SUCCESS) {
+				throw std::runtime_error("failed to record secondary command buffer!");
+			}
+		});
+
+		vkCmdExecuteCommands(commandBuffer, recordParts, secondaries);
+	}
+
+	// Lesson 22.5 --- Draw calls
+	// This is where the commands that actually draw something on screen are!
+	void recordCommandBuffer(VkCommandBuffer commandBuffer, int imageIndex,
+							 VkCommandBufferUsageFlags flags) {
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = flags;
+		beginInfo.pInheritanceInfo = nullptr; // Optional
+
+		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) !=
+					VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+		
+		populateComputeCommands(commandBuffer, imageIndex);
+
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = renderPass; 
+		renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+		renderPassInfo.renderArea.offset = {0, 0};
+		renderPassInfo.renderArea.extent = swapChainExtent;
+
+		std::array<VkClearValue, 2> clearValues{};
+		clearValues[0].color = initialBackgroundColor;
+		clearValues[1].depthStencil = {1.0f, 0};
+
+		renderPassInfo.clearValueCount =
+						static_cast<uint32_t>(clearValues.size());
+		renderPassInfo.pClearValues = clearValues.data();
+		
+		bool secondaries = recordInParallel && recordEveryFrame;
+		VkSubpassContents contents = secondaries ?
+				VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS :
+				VK_SUBPASS_CONTENTS_INLINE;
+		if (depthPrepass) {
+			vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+					VK_SUBPASS_CONTENTS_INLINE);
+			populateDepthPrepass(commandBuffer, imageIndex);
+			vkCmdNextSubpass(commandBuffer, contents);
+		} else {
+			vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, contents);
+		}
+
+		if (secondaries) {
+			recordSecondaryCommandBuffers(commandBuffer, imageIndex);
+		} else {
+			populateCommandBuffer(commandBuffer, imageIndex);
+		}
+
+		vkCmdEndRenderPass(commandBuffer);
+
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+	}
+    
+    // Lesson 22.5
+    void createSyncObjects() {
+    	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+    	    	
     	VkSemaphoreCreateInfo semaphoreInfo{};
 		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 		
@@ -1381,6 +2488,24 @@ protected:
 		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
 		
 		updateUniformBuffer(imageIndex);
+
+		if (streamTextures) {
+			streamer.update();
+			// the fence of the image was waited: its sets and command buffer are idle
+			if (streamer.refresh(imageIndex) && !recordEveryFrame) {
+				recreateCommandBuffer(imageIndex);
+			}
+		}
+
+		// the fence wait above guarantees this frame's pool is no longer in use
+		VkCommandBuffer commandBuffer = commandBuffers.empty() ?
+										VK_NULL_HANDLE : commandBuffers[imageIndex];
+		if (recordEveryFrame) {
+			vkResetCommandPool(device, frameCommandPools[currentFrame], 0);
+			commandBuffer = frameCommandBuffers[currentFrame];
+			recordCommandBuffer(commandBuffer, imageIndex,
+								VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+		}
 		
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -1391,7 +2516,7 @@ protected:
 		submitInfo.pWaitSemaphores = waitSemaphores;
 		submitInfo.pWaitDstStageMask = waitStages;
 		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+		submitInfo.pCommandBuffers = &commandBuffer;
 		VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
 		submitInfo.signalSemaphoreCount = 1;
 		submitInfo.pSignalSemaphores = signalSemaphores;
@@ -1428,14 +2553,22 @@ protected:
     void cleanup() {
 		vkDestroyImageView(device, depthImageView, nullptr);
 		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMemory, nullptr);
+		allocator.free(depthImageMemory);
 
 		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
 			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
 		}
 		
-		vkFreeCommandBuffers(device, commandPool,
-				static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		if (!commandBuffers.empty()) {
+			vkFreeCommandBuffers(device, commandPool,
+					static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		}
+		for (size_t i = 0; i < frameCommandPools.size(); i++) {
+			vkDestroyCommandPool(device, frameCommandPools[i], nullptr);
+		}
+		for (size_t i = 0; i < secondaryCommandPools.size(); i++) {
+			vkDestroyCommandPool(device, secondaryCommandPools[i], nullptr);
+		}
 
 		vkDestroyRenderPass(device, renderPass, nullptr);
 
@@ -1449,6 +2582,14 @@ protected:
     	
     	
 		localCleanup();
+		textures.cleanup();
+		if (streamTextures) {
+			streamer.cleanup();
+		}
+		if (bindlessTextures) {
+			textureTable.cleanup();
+		}
+		samplers.cleanup();
     	
     	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
 			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
@@ -1456,7 +2597,17 @@ protected:
 			vkDestroyFence(device, inFlightFences[i], nullptr);
     	}
     	
+    	// flushes pending copies with command buffers from commandPool
+    	geometry.cleanup();
+    	uploader.cleanup();
+
     	vkDestroyCommandPool(device, commandPool, nullptr);
+
+		savePipelineCache();
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
+    	
+    	workers.cleanup();
+    	allocator.cleanup();
     	
  		vkDestroyDevice(device, nullptr);
 		
@@ -1486,149 +2637,1368 @@ void Model::loadModel(std::string file) {
 	std::cout << "*****************SHAPES******************" << std::endl;
 	for (const auto& shape : shapes) {
 		std::cout << shape.name << std::endl;
-		for (const auto& index : shape.mesh.indices) {
-			Vertex vertex{};
-			
-			vertex.pos = {
-				attrib.vertices[3 * index.vertex_index + 0],
-				attrib.vertices[3 * index.vertex_index + 1],
-				attrib.vertices[3 * index.vertex_index + 2]
-			};
-			
-			if (attrib.texcoords.size() > 0) {
-				vertex.texCoord = {
-					attrib.texcoords[2 * index.texcoord_index + 0],
-					1 - attrib.texcoords[2 * index.texcoord_index + 1] 
-				};
-			} else {
-				vertex.texCoord = { 0.0f, 0.0f };
-			}
+		size_t firstVertex = vertices.size();
+		loadShape(attrib, shape);
+		std::cout << "Vertices: " << shape.mesh.indices.size() << " -> "
+				  << (vertices.size() - firstVertex) << "\n";
+	}
+}
+
+// Appends a shape as an indexed mesh: corners sharing the same
+// (position, normal, texcoord) indices are emitted only once
+void Model::loadShape(const tinyobj::attrib_t &attrib, const tinyobj::shape_t &shape) {
+	std::unordered_map<tinyobj::index_t, uint32_t, ObjIndexHash, ObjIndexEqual> uniqueVertices;
+	uniqueVertices.reserve(shape.mesh.indices.size());
+	for (const auto& index : shape.mesh.indices) {
+		auto found = uniqueVertices.find(index);
+		if (found != uniqueVertices.end()) {
+			indices.push_back(found->second);
+			continue;
+		}
 
-			vertex.norm = {
-				attrib.normals[3 * index.normal_index + 0],
-				attrib.normals[3 * index.normal_index + 1],
-				attrib.normals[3 * index.normal_index + 2]
+		Vertex vertex{};
+		
+		vertex.pos = {
+			attrib.vertices[3 * index.vertex_index + 0],
+			attrib.vertices[3 * index.vertex_index + 1],
+			attrib.vertices[3 * index.vertex_index + 2]
+		};
+		
+		if (attrib.texcoords.size() > 0 && index.texcoord_index != -1) {
+			vertex.texCoord = {
+				attrib.texcoords[2 * index.texcoord_index + 0],
+				1 - attrib.texcoords[2 * index.texcoord_index + 1] 
 			};
-			
-			vertices.push_back(vertex);
-			indices.push_back(vertices.size()-1);
+		} else {
+			vertex.texCoord = { 0.0f, 0.0f };
 		}
+
+		vertex.norm = {
+			attrib.normals[3 * index.normal_index + 0],
+			attrib.normals[3 * index.normal_index + 1],
+			attrib.normals[3 * index.normal_index + 2]
+		};
+		
+		uint32_t newIndex = static_cast<uint32_t>(vertices.size());
+		uniqueVertices.emplace(index, newIndex);
+		vertices.push_back(vertex);
+		indices.push_back(newIndex);
 	}
-	
-	
 }
 
-// Lesson 21
-void Model::createVertexBuffer() {
-	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-	
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-						vertexBuffer, vertexBufferMemory);
+void Model::loadView(const MeshView &view) {
+	vertices.assign(view.vertices, view.vertices + view.vertexCount);
+	indices.assign(view.indices, view.indices + view.indexCount);
+}
 
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);			
+void Model::init(BaseProject *bp, std::string file) {
+	BP = bp;
+	if (!file.empty())
+		loadModel(file);
+	computeBounds();
+	BP->geometry.add(*this);
 }
 
-void Model::createIndexBuffer() {
-	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+// Draws the range source already has in the geometry buffer: the model
+// keeps only the bounds of its own vertices
+void Model::initShared(BaseProject *bp, const Model &source) {
+	BP = bp;
+	computeBounds();
+	firstIndex = source.firstIndex;
+	indexCount = source.indexCount;
+	vertexOffset = source.vertexOffset;
+	std::vector<Vertex>().swap(vertices);
+	std::vector<uint32_t>().swap(indices);
+}
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-							 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-							 indexBuffer, indexBufferMemory);
+void Model::computeBounds() {
+	if (vertices.empty()) {
+		bbMin = bbMax = glm::vec3(0.0f);
+		return;
+	}
+	bbMin = bbMax = vertices[0].pos;
+	for (const Vertex &v : vertices) {
+		bbMin = glm::min(bbMin, v.pos);
+		bbMax = glm::max(bbMax, v.pos);
+	}
+}
 
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+// Planes are sums and differences of the matrix rows (Gribb and Hartmann),
+// with depth in [0, 1] as in GLM_FORCE_DEPTH_ZERO_TO_ONE
+void Frustum::extract(const glm::mat4 &viewProj) {
+	glm::mat4 m = glm::transpose(viewProj);
+	planes[0] = m[3] + m[0];	// left
+	planes[1] = m[3] - m[0];	// right
+	planes[2] = m[3] + m[1];	// bottom
+	planes[3] = m[3] - m[1];	// top
+	planes[4] = m[2];			// near
+	planes[5] = m[3] - m[2];	// far
+	for (int i = 0; i < 6; i++) {
+		planes[i] /= glm::length(glm::vec3(planes[i]));
+	}
 }
 
-void Model::init(BaseProject *bp, std::string file) {
+// The box is moved to world space as a center and half extents, then it
+// is outside when it is fully behind one of the planes
+bool Frustum::intersects(const glm::vec3 &bbMin, const glm::vec3 &bbMax,
+						 const glm::mat4 &transform) const {
+	glm::vec3 center = glm::vec3(transform * glm::vec4((bbMin + bbMax) * 0.5f, 1.0f));
+	glm::vec3 half = (bbMax - bbMin) * 0.5f;
+	glm::mat3 absTransform = glm::mat3(transform);
+	for (int i = 0; i < 3; i++) {
+		absTransform[i] = glm::abs(absTransform[i]);
+	}
+	glm::vec3 extent = absTransform * half;
+
+	for (int i = 0; i < 6; i++) {
+		glm::vec3 n = glm::vec3(planes[i]);
+		float radius = glm::dot(glm::abs(n), extent);
+		if (glm::dot(n, center) + planes[i].w < -radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+uint64_t RenderQueue::makeKey(uint32_t pipeline, uint32_t material, uint32_t mesh,
+							  float depth, float maxDepth) {
+	const uint64_t depthMax = (1u << 24) - 1;
+	uint64_t quantized = static_cast<uint64_t>(
+		std::min(std::max(depth / maxDepth, 0.0f), 1.0f) * depthMax);
+	return (uint64_t)(pipeline & 0xF) << 60 |
+		   (uint64_t)(material & 0xFFFF) << 44 |
+		   (uint64_t)(mesh & 0xFFFFF) << 24 |
+		   quantized;
+}
+
+void RenderQueue::clear() {
+	keys.clear();
+	items.clear();
+}
+
+void RenderQueue::push(uint64_t key, uint32_t item) {
+	keys.push_back(key);
+	items.push_back(item);
+}
+
+// LSD radix sort, one byte per pass. Passes where all the keys share the
+// byte are skipped, which is most of them with few pipelines and materials.
+void RenderQueue::sort() {
+	size_t n = keys.size();
+	sortedKeys.resize(n);
+	sortedItems.resize(n);
+	for (int shift = 0; shift < 64; shift += 8) {
+		size_t count[256] = {};
+		for (uint64_t key : keys) {
+			count[(key >> shift) & 0xFF]++;
+		}
+		if (count[(keys.empty() ? 0 : keys[0] >> shift) & 0xFF] == n) {
+			continue;
+		}
+
+		size_t offset = 0;
+		for (size_t &c : count) {
+			size_t bucket = c;
+			c = offset;
+			offset += bucket;
+		}
+		for (size_t i = 0; i < n; i++) {
+			size_t dst = count[(keys[i] >> shift) & 0xFF]++;
+			sortedKeys[dst] = keys[i];
+			sortedItems[dst] = items[i];
+		}
+		keys.swap(sortedKeys);
+		items.swap(sortedItems);
+	}
+}
+
+void GeometryBuffer::init(BaseProject *bp) {
 	BP = bp;
-	if (!file.empty())
-		loadModel(file);
-	createVertexBuffer();
-	createIndexBuffer();
 }
 
+// Appends the model and records its range. The model drops its own copy
+// of the data, which now lives in the shared arrays.
+void GeometryBuffer::add(Model &model) {
+	model.firstIndex = static_cast<uint32_t>(indices.size());
+	model.indexCount = static_cast<uint32_t>(model.indices.size());
+	model.vertexOffset = static_cast<int32_t>(vertices.size());
+
+	vertices.insert(vertices.end(), model.vertices.begin(), model.vertices.end());
+	indices.insert(indices.end(), model.indices.begin(), model.indices.end());
+
+	std::vector<Vertex>().swap(model.vertices);
+	std::vector<uint32_t>().swap(model.indices);
+}
+
+// Lesson 21
+void GeometryBuffer::build() {
+	if (vertices.empty() || indices.empty())
+		return;
+
+	VkDeviceSize vertexSize = sizeof(vertices[0]) * vertices.size();
+	BP->createBuffer(vertexSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+						VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						vertexBuffer, vertexBufferMemory, ALLOC_LINEAR);
+	BP->uploader.upload(vertexBuffer, vertices.data(), vertexSize);
+
+	VkDeviceSize indexSize = sizeof(indices[0]) * indices.size();
+	BP->createBuffer(indexSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+						VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						indexBuffer, indexBufferMemory, ALLOC_LINEAR);
+	BP->uploader.upload(indexBuffer, indices.data(), indexSize);
+
+	if (BP->depthPrepass) {
+		std::vector<glm::vec3> positions(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++) {
+			positions[i] = vertices[i].pos;
+		}
+		VkDeviceSize positionSize = sizeof(positions[0]) * positions.size();
+		BP->createBuffer(positionSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+							VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+							VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+							positionBuffer, positionBufferMemory, ALLOC_LINEAR);
+		BP->uploader.upload(positionBuffer, positions.data(), positionSize);
+	}
+
+	std::cout << "Geometry: " << vertices.size() << " vertices, "
+			  << indices.size() << " indices\n";
+
+	// the uploader keeps its own copy until flush()
+	std::vector<Vertex>().swap(vertices);
+	std::vector<uint32_t>().swap(indices);
+}
+
+void GeometryBuffer::bind(VkCommandBuffer commandBuffer) {
+	VkBuffer vertexBuffers[] = {vertexBuffer};
+	VkDeviceSize offsets[] = {0};
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+// Same indices and vertex offsets as bind(), with the position stream
+void GeometryBuffer::bindPositions(VkCommandBuffer commandBuffer) {
+	VkBuffer vertexBuffers[] = {positionBuffer};
+	VkDeviceSize offsets[] = {0};
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+void GeometryBuffer::cleanup() {
+	if (positionBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(BP->device, positionBuffer, nullptr);
+		BP->allocator.free(positionBufferMemory);
+	}
+	if (indexBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(BP->device, indexBuffer, nullptr);
+		BP->allocator.free(indexBufferMemory);
+	}
+	if (vertexBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
+		BP->allocator.free(vertexBufferMemory);
+	}
+}
+
+// FNV-1a over the whole file, chained on hash. Missing files hash as empty.
+uint64_t MeshCache::hashFile(const std::string &file, uint64_t hash) {
+	std::vector<char> content;
+	std::ifstream in(file, std::ios::ate | std::ios::binary);
+	if (in.is_open()) {
+		content.resize((size_t) in.tellg());
+		in.seekg(0);
+		in.read(content.data(), content.size());
+	}
+	for (char c : content) {
+		hash ^= (uint8_t) c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// The .mtl files named by the mtllib lines of the .obj, relative paths
+// resolved against its directory
+std::vector<std::string> MeshCache::mtllibs(const std::string &objFile) {
+	std::filesystem::path dir = std::filesystem::path(objFile).parent_path();
+	std::vector<std::string> mtls;
+	std::ifstream in(objFile);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.compare(0, 7, "mtllib ") != 0) {
+			continue;
+		}
+		std::istringstream names(line.substr(7));
+		std::string name;
+		while (names >> name) {
+			std::filesystem::path path(name);
+			if (path.is_relative()) {
+				path = dir / path;
+			}
+			mtls.push_back(path.lexically_normal().string());
+		}
+	}
+	return mtls;
+}
+
+// Hashes the .obj and its .mtl files
+uint64_t MeshCache::hashSources(const std::string &objFile, const std::vector<std::string> &mtls) {
+	uint64_t hash = hashFile(objFile, 14695981039346656037ull);
+	for (const std::string &mtl : mtls) {
+		hash = hashFile(mtl, hash);
+	}
+	return hash;
+}
+
+// FNV-1a over the size and the write time of the file, chained on stamp.
+// Unlike hashFile it does not read the file.
+uint64_t MeshCache::stampFile(const std::string &file, uint64_t stamp) {
+	std::error_code error;
+	uint64_t values[2] = {
+		(uint64_t) std::filesystem::file_size(file, error),
+		(uint64_t) std::filesystem::last_write_time(file, error).time_since_epoch().count()};
+	const uint8_t *bytes = (const uint8_t *) values;
+	for (size_t i = 0; i < sizeof(values); i++) {
+		stamp ^= bytes[i];
+		stamp *= 1099511628211ull;
+	}
+	return stamp;
+}
+
+// Stamps the .obj and its .mtl files. Those are listed in the cache, so the
+// .obj is not read to find its mtllib lines; if they changed, so did the .obj.
+uint64_t MeshCache::stampSources(const std::string &objFile, const std::vector<std::string> &mtls) {
+	uint64_t stamp = stampFile(objFile, 14695981039346656037ull);
+	for (const std::string &mtl : mtls) {
+		stamp = stampFile(mtl, stamp);
+	}
+	return stamp;
+}
+
+bool MeshCache::restamp(const std::string &file, size_t offset, uint64_t sourceStamp) {
+	std::fstream out(file, std::ios::in | std::ios::out | std::ios::binary);
+	out.seekp(offset);
+	out.write((const char *) &sourceStamp, sizeof(sourceStamp));
+	return out.good();
+}
+
+bool MeshCache::write(const std::string &file, const std::string &objFile,
+					  const std::vector<std::string> &names,
+					  const std::vector<Model> &meshes) {
+	std::vector<std::string> mtls = mtllibs(objFile);
+	std::vector<MeshCacheMaterialFile> materialEntries(mtls.size());
+	for (size_t i = 0; i < mtls.size(); i++) {
+		if (mtls[i].size() >= sizeof(materialEntries[i].path)) {
+			return false;
+		}
+		strncpy(materialEntries[i].path, mtls[i].c_str(), sizeof(materialEntries[i].path) - 1);
+	}
+
+	std::ofstream out(file, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		return false;
+	}
+
+	MeshCacheHeader header{};
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = MESH_CACHE_VERSION;
+	header.sourceHash = hashSources(objFile, mtls);
+	header.sourceStamp = stampSources(objFile, mtls);
+	header.shapeCount = static_cast<uint32_t>(meshes.size());
+	header.vertexSize = sizeof(Vertex);
+	header.materialFileCount = static_cast<uint32_t>(mtls.size());
+
+	// blobs start after the tables, each one 16 bytes aligned
+	auto align = [](uint64_t offset) { return (offset + 15) & ~uint64_t(15); };
+	std::vector<MeshCacheShape> entries(meshes.size());
+	uint64_t offset = align(sizeof(MeshCacheHeader) + sizeof(MeshCacheShape) * meshes.size() +
+							sizeof(MeshCacheMaterialFile) * mtls.size());
+	for (size_t i = 0; i < meshes.size(); i++) {
+		strncpy(entries[i].name, names[i].c_str(), sizeof(entries[i].name) - 1);
+		entries[i].vertexCount = static_cast<uint32_t>(meshes[i].vertices.size());
+		entries[i].indexCount = static_cast<uint32_t>(meshes[i].indices.size());
+		entries[i].vertexOffset = offset;
+		offset = align(offset + sizeof(Vertex) * meshes[i].vertices.size());
+		entries[i].indexOffset = offset;
+		offset = align(offset + sizeof(uint32_t) * meshes[i].indices.size());
+	}
+
+	out.write((const char *) &header, sizeof(header));
+	out.write((const char *) entries.data(), sizeof(MeshCacheShape) * entries.size());
+	out.write((const char *) materialEntries.data(),
+			  sizeof(MeshCacheMaterialFile) * materialEntries.size());
+	for (size_t i = 0; i < meshes.size(); i++) {
+		out.seekp(entries[i].vertexOffset);
+		out.write((const char *) meshes[i].vertices.data(), sizeof(Vertex) * meshes[i].vertices.size());
+		out.seekp(entries[i].indexOffset);
+		out.write((const char *) meshes[i].indices.data(), sizeof(uint32_t) * meshes[i].indices.size());
+	}
+	return out.good();
+}
+
+// Maps the cache file, returns false if it is missing, truncated or stale
+bool MeshCache::open(const std::string &file, const std::string &objFile) {
+#ifdef _WIN32
+	fileHandle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+							 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(fileHandle, &fileSize);
+	size = (size_t) fileSize.QuadPart;
+	mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle != nullptr) {
+		data = (const char *) MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		size = (size_t) st.st_size;
+		void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		data = mapped == MAP_FAILED ? nullptr : (const char *) mapped;
+	}
+	::close(fd);
+#endif
+	if (data == nullptr) {
+		close();
+		return false;
+	}
+
+	header = (const MeshCacheHeader *) data;
+	shapes = (const MeshCacheShape *) (data + sizeof(MeshCacheHeader));
+	bool valid = size >= sizeof(MeshCacheHeader) &&
+				 memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+				 header->version == MESH_CACHE_VERSION &&
+				 header->vertexSize == sizeof(Vertex) &&
+				 size >= sizeof(MeshCacheHeader) + sizeof(MeshCacheShape) * header->shapeCount +
+						 sizeof(MeshCacheMaterialFile) * header->materialFileCount;
+	for (uint32_t i = 0; valid && i < header->shapeCount; i++) {
+		valid = shapes[i].vertexOffset + sizeof(Vertex) * shapes[i].vertexCount <= size &&
+				shapes[i].indexOffset + sizeof(uint32_t) * shapes[i].indexCount <= size;
+	}
+	std::vector<std::string> mtls;
+	if (valid) {
+		materialFiles = (const MeshCacheMaterialFile *) (shapes + header->shapeCount);
+	}
+	for (uint32_t i = 0; valid && i < header->materialFileCount; i++) {
+		const char *path = materialFiles[i].path;
+		mtls.emplace_back(path, strnlen(path, sizeof(materialFiles[i].path)));
+	}
+	// touched sources are hashed, the cache is still good if they did not change
+	uint64_t sourceStamp = valid ? stampSources(objFile, mtls) : 0;
+	bool touched = valid && header->sourceStamp != sourceStamp;
+	if (touched) {
+		valid = header->sourceHash == hashSources(objFile, mtllibs(objFile));
+	}
+	if (!valid || touched) {
+		close();
+	}
+	if (touched && valid) {
+		return restamp(file, offsetof(MeshCacheHeader, sourceStamp), sourceStamp) &&
+			   open(file, objFile);
+	}
+	return valid;
+}
+
+void MeshCache::close() {
+#ifdef _WIN32
+	if (data != nullptr) UnmapViewOfFile(data);
+	if (mappingHandle != nullptr) CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	if (data != nullptr) munmap((void *) data, size);
+#endif
+	data = nullptr;
+	size = 0;
+	header = nullptr;
+	shapes = nullptr;
+	materialFiles = nullptr;
+}
+
+MeshView MeshCache::view(int shape) const {
+	const MeshCacheShape &S = shapes[shape];
+	return {S.name,
+			(const Vertex *) (data + S.vertexOffset), S.vertexCount,
+			(const uint32_t *) (data + S.indexOffset), S.indexCount};
+}
+
+void WorkerPool::init(int threadCount) {
+	for (int i = 0; i < threadCount; i++) {
+		threads.emplace_back([this]() {
+			std::unique_lock<std::mutex> lock(mutex);
+			uint64_t seen = 0;
+			while (true) {
+				wake.wait(lock, [&]() { return stopping || generation != seen; });
+				if (stopping) {
+					return;
+				}
+				seen = generation;
+				runJobs(lock);
+			}
+		});
+	}
+}
+
+// Pulls job indices until none are left. Called with the mutex held.
+void WorkerPool::runJobs(std::unique_lock<std::mutex> &lock) {
+	running++;
+	while (nextJob < jobCount) {
+		int i = nextJob++;
+		lock.unlock();
+		try {
+			job(i);
+		} catch (...) {
+			lock.lock();
+			if (!error) error = std::current_exception();
+			lock.unlock();
+		}
+		lock.lock();
+	}
+	if (--running == 0) {
+		done.notify_all();
+	}
+}
+
+void WorkerPool::parallelFor(int count, const std::function<void(int)> &fn) {
+	std::unique_lock<std::mutex> lock(mutex);
+	job = fn;
+	jobCount = count;
+	nextJob = 0;
+	error = nullptr;
+	generation++;
+	wake.notify_all();
+
+	runJobs(lock);
+	done.wait(lock, [&]() { return running == 0 && nextJob >= jobCount; });
+	job = nullptr;
+
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+void WorkerPool::cleanup() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto &t : threads) {
+		t.join();
+	}
+	threads.clear();
+}
+
+// The buffers belong to BaseProject::geometry, released in its cleanup()
 void Model::cleanup() {
-   	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-   	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
-	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-   	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
 }
 
+void MemoryAllocator::init(BaseProject *bp, VkDeviceSize size) {
+	BP = bp;
+	blockSize = size;
+	vkGetPhysicalDeviceMemoryProperties(BP->physicalDevice, &memProperties);
+}
+
+void MemoryAllocator::createBlock(MemoryPool &pool, VkDeviceSize size) {
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = pool.memoryType;
+
+	MemoryBlock block{};
+	block.size = size;
+	VkResult result = vkAllocateMemory(BP->device, &allocInfo, nullptr,
+									   &block.memory);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to allocate memory block!");
+	}
+
+	if (memProperties.memoryTypes[pool.memoryType].propertyFlags &
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		vkMapMemory(BP->device, block.memory, 0, size, 0, (void **) &block.mapped);
+	}
+	block.freeRanges.push_back({0, size});
+
+	// reuse the slot of a released block, so indices in allocations stay valid
+	for (auto &b : pool.blocks) {
+		if (b.memory == VK_NULL_HANDLE) {
+			b = block;
+			return;
+		}
+	}
+	pool.blocks.push_back(block);
+}
+
+bool MemoryAllocator::allocateFromBlock(MemoryBlock &block, AllocationStrategy strategy,
+										VkDeviceSize size, VkDeviceSize alignment,
+										VkDeviceSize &offset) {
+	if (block.memory == VK_NULL_HANDLE) {
+		return false;
+	}
+
+	if (strategy == ALLOC_LINEAR) {
+		offset = (block.top + alignment - 1) / alignment * alignment;
+		if (offset + size > block.size) {
+			return false;
+		}
+		block.top = offset + size;
+		return true;
+	}
+
+	// first fit, the space skipped for alignment stays free
+	for (size_t i = 0; i < block.freeRanges.size(); i++) {
+		MemoryRange range = block.freeRanges[i];
+		offset = (range.offset + alignment - 1) / alignment * alignment;
+		if (offset + size > range.offset + range.size) {
+			continue;
+		}
+
+		block.freeRanges.erase(block.freeRanges.begin() + i);
+		VkDeviceSize end = range.offset + range.size;
+		if (offset + size < end) {
+			block.freeRanges.insert(block.freeRanges.begin() + i, {offset + size, end - offset - size});
+		}
+		if (range.offset < offset) {
+			block.freeRanges.insert(block.freeRanges.begin() + i, {range.offset, offset - range.offset});
+		}
+		return true;
+	}
+	return false;
+}
+
+MemoryAllocation MemoryAllocator::allocate(const VkMemoryRequirements &memRequirements,
+										   VkMemoryPropertyFlags properties,
+										   AllocationStrategy strategy, bool image) {
+	uint32_t memoryType = BP->findMemoryType(memRequirements.memoryTypeBits,
+											 properties);
+
+	int p = 0;
+	while (p < (int) pools.size() && !(pools[p].memoryType == memoryType &&
+			pools[p].strategy == strategy && pools[p].image == image)) {
+		p++;
+	}
+	if (p == (int) pools.size()) {
+		pools.push_back({memoryType, strategy, image, {}});
+	}
+	MemoryPool &pool = pools[p];
+
+	MemoryAllocation allocation;
+	allocation.pool = p;
+	allocation.size = memRequirements.size;
+
+	for (int b = 0; allocation.block < 0 && b < (int) pool.blocks.size(); b++) {
+		if (allocateFromBlock(pool.blocks[b], strategy, memRequirements.size,
+							  memRequirements.alignment, allocation.offset)) {
+			allocation.block = b;
+		}
+	}
+	if (allocation.block < 0) {
+		// resources bigger than a block get a block of their own
+		createBlock(pool, std::max(blockSize, memRequirements.size));
+		for (int b = 0; allocation.block < 0 && b < (int) pool.blocks.size(); b++) {
+			if (allocateFromBlock(pool.blocks[b], strategy, memRequirements.size,
+								  memRequirements.alignment, allocation.offset)) {
+				allocation.block = b;
+			}
+		}
+	}
+	if (allocation.block < 0) {
+		throw std::runtime_error("failed to sub-allocate memory!");
+	}
+
+	MemoryBlock &block = pool.blocks[allocation.block];
+	block.liveOffsets.insert(allocation.offset);
+	block.used += allocation.size;
+	allocation.memory = block.memory;
+	if (block.mapped != nullptr) {
+		allocation.mapped = block.mapped + allocation.offset;
+	}
+	return allocation;
+}
+
+void MemoryAllocator::free(MemoryAllocation &allocation) {
+	if (allocation.memory == VK_NULL_HANDLE) {
+		return;
+	}
+	MemoryPool &pool = pools[allocation.pool];
+	MemoryBlock &block = pool.blocks[allocation.block];
+
+	// a copy of an allocation freed before, maybe from a released block
+	auto live = block.memory == allocation.memory ?
+				block.liveOffsets.find(allocation.offset) : block.liveOffsets.end();
+	assert(live != block.liveOffsets.end() && "memory allocation freed twice");
+	if (live == block.liveOffsets.end()) {
+		allocation = MemoryAllocation{};
+		return;
+	}
+	block.liveOffsets.erase(live);
+	block.used -= allocation.size;
+
+	if (pool.strategy == ALLOC_FREE_LIST) {
+		// insert sorted and merge with the neighbours
+		size_t i = 0;
+		while (i < block.freeRanges.size() &&
+				block.freeRanges[i].offset + block.freeRanges[i].size <= allocation.offset) {
+			i++;
+		}
+		block.freeRanges.insert(block.freeRanges.begin() + i, {allocation.offset, allocation.size});
+		if (i + 1 < block.freeRanges.size() &&
+				block.freeRanges[i].offset + block.freeRanges[i].size == block.freeRanges[i + 1].offset) {
+			block.freeRanges[i].size += block.freeRanges[i + 1].size;
+			block.freeRanges.erase(block.freeRanges.begin() + i + 1);
+		}
+		if (i > 0 &&
+				block.freeRanges[i - 1].offset + block.freeRanges[i - 1].size == block.freeRanges[i].offset) {
+			block.freeRanges[i - 1].size += block.freeRanges[i].size;
+			block.freeRanges.erase(block.freeRanges.begin() + i);
+		}
+	}
 
+	if (block.liveOffsets.empty()) {
+		block.top = 0;
+		// keep one block per pool around, release the others
+		int liveBlocks = 0;
+		for (auto &b : pool.blocks) {
+			if (b.memory != VK_NULL_HANDLE) liveBlocks++;
+		}
+		if (liveBlocks > 1) {
+			vkFreeMemory(BP->device, block.memory, nullptr);
+			block = MemoryBlock{};
+		}
+	}
+	// the freed allocation no longer refers to any block
+	allocation = MemoryAllocation{};
+}
 
+// Fragmentation is 1 - largest free range / total free space of free list blocks
+void MemoryAllocator::printStats() {
+	int blocks = 0, allocations = 0;
+	VkDeviceSize reserved = 0, used = 0, totalFree = 0, largestFree = 0;
+	for (auto &pool : pools) {
+		for (auto &block : pool.blocks) {
+			if (block.memory == VK_NULL_HANDLE) continue;
+			blocks++;
+			allocations += (int) block.liveOffsets.size();
+			reserved += block.size;
+			used += block.used;
+			if (pool.strategy == ALLOC_FREE_LIST) {
+				for (auto &range : block.freeRanges) {
+					totalFree += range.size;
+					largestFree = std::max(largestFree, range.size);
+				}
+			}
+		}
+	}
+	float fragmentation = totalFree > 0 ? 1.0f - (float) largestFree / totalFree : 0.0f;
+	std::cout << "GPU memory: " << allocations << " allocations in " << blocks
+			  << " blocks, " << used / 1024 << " KB used of " << reserved / 1024
+			  << " KB, fragmentation " << fragmentation * 100.0f << "%\n";
+}
+
+void MemoryAllocator::cleanup() {
+	for (auto &pool : pools) {
+		for (auto &block : pool.blocks) {
+			if (block.memory != VK_NULL_HANDLE) {
+				vkFreeMemory(BP->device, block.memory, nullptr);
+			}
+		}
+	}
+	pools.clear();
+}
+
+void StagingUploader::init(BaseProject *bp, VkDeviceSize size) {
+	BP = bp;
+	stagingSize = size;
+	stagingOffset = 0;
+
+	BP->createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 stagingBuffer, stagingBufferMemory);
 
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	VkResult result = vkCreateFence(BP->device, &fenceInfo, nullptr, &fence);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create upload fence!");
+	}
+}
+
+// Copies src into the ring, or into a buffer of its own when it does not fit
+VkBuffer StagingUploader::stage(const void *src, VkDeviceSize size, VkDeviceSize &srcOffset) {
+	// the ring is still read by the submitted copies
+	wait();
+	VkBuffer srcBuffer = stagingBuffer;
+
+	if (size > stagingSize) {
+		VkBuffer buffer;
+		MemoryAllocation memory;
+		BP->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+						 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+						 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+						 buffer, memory);
+		memcpy(memory.mapped, src, (size_t) size);
+		oversizeBuffers.push_back(buffer);
+		oversizeBuffersMemory.push_back(memory);
+		srcBuffer = buffer;
+		srcOffset = 0;
+	} else {
+		// copies are 16 bytes aligned inside the ring
+		srcOffset = (stagingOffset + 15) & ~VkDeviceSize(15);
+		if (srcOffset + size > stagingSize) {
+			flush();
+			srcOffset = 0;
+		}
+		memcpy(stagingBufferMemory.mapped + srcOffset, src, (size_t) size);
+		stagingOffset = srcOffset + size;
+	}
+
+	if (commandBuffer == VK_NULL_HANDLE) {
+		commandBuffer = BP->beginSingleTimeCommands();
+	}
+	return srcBuffer;
+}
+
+void StagingUploader::upload(VkBuffer dst, const void *src, VkDeviceSize size) {
+	VkDeviceSize srcOffset;
+	VkBuffer srcBuffer = stage(src, size, srcOffset);
+
+	VkBufferCopy copyRegion{};
+	copyRegion.srcOffset = srcOffset;
+	copyRegion.dstOffset = 0;
+	copyRegion.size = size;
+	vkCmdCopyBuffer(commandBuffer, srcBuffer, dst, 1, &copyRegion);
+	pendingCopies++;
+}
+
+void StagingUploader::uploadImage(VkImage dst, const void *src, VkDeviceSize size,
+								  const std::vector<VkBufferImageCopy> &regions,
+								  uint32_t mipLevels) {
+	VkDeviceSize srcOffset;
+	VkBuffer srcBuffer = stage(src, size, srcOffset);
+
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = dst;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = mipLevels;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+						 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+						 VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+						 0, nullptr, 0, nullptr, 1, &barrier);
+
+	std::vector<VkBufferImageCopy> copies = regions;
+	for (auto &copy : copies) {
+		copy.bufferOffset += srcOffset;
+	}
+	vkCmdCopyBufferToImage(commandBuffer, srcBuffer, dst,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			static_cast<uint32_t>(copies.size()), copies.data());
+
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+						 VK_PIPELINE_STAGE_TRANSFER_BIT,
+						 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+						 0, nullptr, 0, nullptr, 1, &barrier);
+	pendingCopies++;
+}
+
+// Submits every pending copy with one vkQueueSubmit and waits for it
+void StagingUploader::flush() {
+	int copies = pendingCopies;
+	submit();
+	wait();
+	if (copies > 0) {
+		std::cout << "Uploaded " << copies << " buffers and images in one submit\n";
+	}
+}
+
+void StagingUploader::submit() {
+	if (commandBuffer == VK_NULL_HANDLE || submitted) {
+		return;
+	}
+
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+							VK_ACCESS_INDEX_READ_BIT |
+							VK_ACCESS_UNIFORM_READ_BIT |
+							VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+						 VK_PIPELINE_STAGE_TRANSFER_BIT,
+						 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+						 VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+						 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+						 1, &barrier, 0, nullptr, 0, nullptr);
+	vkEndCommandBuffer(commandBuffer);
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &commandBuffer;
+	VkResult result = vkQueueSubmit(BP->graphicsQueue, 1, &submitInfo, fence);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to submit uploads!");
+	}
+	submitted = true;
+}
+
+// True when nothing submitted is still running
+bool StagingUploader::finished() {
+	return !submitted || vkGetFenceStatus(BP->device, fence) == VK_SUCCESS;
+}
+
+// Waits for the submitted copies and recycles the staging memory
+void StagingUploader::wait() {
+	if (!submitted) {
+		return;
+	}
+	vkWaitForFences(BP->device, 1, &fence, VK_TRUE, UINT64_MAX);
+	vkResetFences(BP->device, 1, &fence);
+	submitted = false;
+
+	vkFreeCommandBuffers(BP->device, BP->commandPool, 1, &commandBuffer);
+	commandBuffer = VK_NULL_HANDLE;
+	pendingCopies = 0;
+	stagingOffset = 0;
+
+	for (size_t i = 0; i < oversizeBuffers.size(); i++) {
+		vkDestroyBuffer(BP->device, oversizeBuffers[i], nullptr);
+		BP->allocator.free(oversizeBuffersMemory[i]);
+	}
+	oversizeBuffers.clear();
+	oversizeBuffersMemory.clear();
+}
+
+void StagingUploader::cleanup() {
+	flush();
+	vkDestroyFence(BP->device, fence, nullptr);
+	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
+	BP->allocator.free(stagingBufferMemory);
+}
+
+// Reads the cooked file of source, cooking and writing it first when it is
+// missing, stale or corrupt. Safe to call from several threads on different
+// files.
+void CookedTexture::load(const std::string &source, bool compressed, uint32_t maxDimension) {
+	std::string cacheFile = source + ".cache";
+	uint64_t sourceStamp = MeshCache::stampFile(source, 14695981039346656037ull);
+
+	if (read(cacheFile, sourceStamp, source, compressed, maxDimension)) {
+		return;
+	}
+	cook(source, MeshCache::hashFile(source, 14695981039346656037ull), compressed);
+	if (header.width > maxDimension || header.height > maxDimension) {
+		throw std::runtime_error("texture " + source + " is larger than the device supports!");
+	}
+	header.sourceStamp = sourceStamp;
+	if (!write(cacheFile)) {
+		std::cout << "Could not write texture cache " << cacheFile << std::endl;
+	}
+}
+
+// Returns false if the file is missing, truncated, stale or in the other
+// kind of format (compressed or not), or if its sizes are not the ones
+// cook() writes: the image and the copies are created from them. The source
+// is hashed only when its stamp changed.
+bool CookedTexture::read(const std::string &file, uint64_t sourceStamp, const std::string &source,
+						 bool compressed, uint32_t maxDimension) {
+	std::ifstream in(file, std::ios::ate | std::ios::binary);
+	if (!in.is_open()) {
+		return false;
+	}
+	uint64_t size = (uint64_t) in.tellg();
+	in.seekg(0);
+
+	in.read((char *) &header, sizeof(header));
+	bool valid = in.good() && size >= sizeof(header) &&
+				 memcmp(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+				 header.version == TEXTURE_CACHE_VERSION &&
+				 header.format <= TEXTURE_BC3 &&
+				 (header.format != TEXTURE_RGBA8) == compressed &&
+				 header.width > 0 && header.width <= maxDimension &&
+				 header.height > 0 && header.height <= maxDimension &&
+				 header.mipLevels == mipChainLength(header.width, header.height) &&
+				 size >= sizeof(header) + sizeof(TextureCacheLevel) * header.mipLevels;
+	if (!valid) {
+		return false;
+	}
+
+	levels.resize(header.mipLevels);
+	in.read((char *) levels.data(), sizeof(TextureCacheLevel) * levels.size());
+	data.resize((size_t) (size - sizeof(header) - sizeof(TextureCacheLevel) * levels.size()));
+	in.read(data.data(), data.size());
+	valid = in.good();
+	uint32_t width = header.width;
+	uint32_t height = header.height;
+	for (uint32_t i = 0; valid && i < header.mipLevels; i++) {
+		const TextureCacheLevel &level = levels[i];
+		valid = level.width == width && level.height == height &&
+				level.size == levelSize(header.format, width, height) &&
+				level.offset <= data.size() && level.size <= data.size() - level.offset;
+		width = std::max(width / 2, 1u);
+		height = std::max(height / 2, 1u);
+	}
+	if (valid && header.sourceStamp != sourceStamp) {
+		valid = header.sourceHash == MeshCache::hashFile(source, 14695981039346656037ull);
+		in.close();
+		if (valid && MeshCache::restamp(file, offsetof(TextureCacheHeader, sourceStamp), sourceStamp)) {
+			header.sourceStamp = sourceStamp;
+		}
+	}
+	return valid;
+}
+
+void CookedTexture::cook(const std::string &source, uint64_t sourceHash, bool compressed) {
+	int texWidth, texHeight, texChannels;
+	stbi_uc* pixels = stbi_load(source.c_str(), &texWidth, &texHeight,
+						&texChannels, STBI_rgb_alpha);
+	if (!pixels) {
+		throw std::runtime_error("failed to load texture image " + source + "!");
+	}
+	uint32_t width = static_cast<uint32_t>(texWidth);
+	uint32_t height = static_cast<uint32_t>(texHeight);
+	std::vector<uint8_t> rgba(pixels, pixels + (size_t) width * height * 4);
+	stbi_image_free(pixels);
+
+	bool opaque = true;
+	for (size_t i = 3; i < rgba.size() && opaque; i += 4) {
+		opaque = rgba[i] == 255;
+	}
+
+	header = {};
+	memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = TEXTURE_CACHE_VERSION;
+	header.sourceHash = sourceHash;
+	header.format = !compressed ? TEXTURE_RGBA8 : opaque ? TEXTURE_BC1 : TEXTURE_BC3;
+	header.width = width;
+	header.height = height;
+	header.mipLevels = mipChainLength(width, height);
+
+	levels.resize(header.mipLevels);
+	data.clear();
+	for (uint32_t i = 0; i < header.mipLevels; i++) {
+		if (i > 0) {
+			rgba = downsample(rgba, width, height);
+			width = std::max(width / 2, 1u);
+			height = std::max(height / 2, 1u);
+		}
+
+		TextureCacheLevel &level = levels[i];
+		level.width = width;
+		level.height = height;
+		level.offset = (data.size() + 15) & ~size_t(15);
+		level.size = levelSize(header.format, width, height);
+		data.resize((size_t) (level.offset + level.size));
+
+		uint8_t *out = (uint8_t *) data.data() + level.offset;
+		if (header.format == TEXTURE_RGBA8) {
+			memcpy(out, rgba.data(), (size_t) level.size);
+		} else {
+			compress(rgba.data(), width, height, header.format == TEXTURE_BC3, out);
+		}
+	}
+}
+
+// Levels down to 1x1, halving each side
+uint32_t CookedTexture::mipChainLength(uint32_t width, uint32_t height) {
+	uint32_t length = 1;
+	for (uint32_t side = std::max(width, height); side > 1; side /= 2) {
+		length++;
+	}
+	return length;
+}
+
+// Bytes of a level: texels for RGBA8, 4x4 blocks for BC1 and BC3
+uint64_t CookedTexture::levelSize(uint32_t format, uint32_t width, uint32_t height) {
+	if (format == TEXTURE_RGBA8) {
+		return (uint64_t) width * height * 4;
+	}
+	uint64_t blocks = (uint64_t) ((width + 3) / 4) * ((height + 3) / 4);
+	return blocks * (format == TEXTURE_BC1 ? 8 : 16);
+}
+
+bool CookedTexture::write(const std::string &file) const {
+	std::ofstream out(file, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		return false;
+	}
+	out.write((const char *) &header, sizeof(header));
+	out.write((const char *) levels.data(), sizeof(TextureCacheLevel) * levels.size());
+	out.write(data.data(), data.size());
+	return out.good();
+}
+
+VkFormat CookedTexture::vkFormat() const {
+	switch (header.format) {
+		case TEXTURE_BC1: return VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+		case TEXTURE_BC3: return VK_FORMAT_BC3_SRGB_BLOCK;
+		default: return VK_FORMAT_R8G8B8A8_SRGB;
+	}
+}
+
+// Next mip level with a 2x2 box filter. Colors are averaged in linear
+// space, as the blits on an sRGB image did.
+std::vector<uint8_t> CookedTexture::downsample(const std::vector<uint8_t> &rgba,
+											   uint32_t width, uint32_t height) {
+	float toLinear[256];
+	for (int i = 0; i < 256; i++) {
+		float c = i / 255.0f;
+		toLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+	}
+	auto toSrgb = [](float c) {
+		c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+		return (uint8_t) std::min(255.0f, std::max(0.0f, c * 255.0f + 0.5f));
+	};
+
+	uint32_t w = std::max(width / 2, 1u);
+	uint32_t h = std::max(height / 2, 1u);
+	std::vector<uint8_t> result((size_t) w * h * 4);
+	for (uint32_t y = 0; y < h; y++) {
+		uint32_t ys[2] = {std::min(2 * y, height - 1), std::min(2 * y + 1, height - 1)};
+		for (uint32_t x = 0; x < w; x++) {
+			uint32_t xs[2] = {std::min(2 * x, width - 1), std::min(2 * x + 1, width - 1)};
+			float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+			for (uint32_t j = 0; j < 2; j++) {
+				for (uint32_t i = 0; i < 2; i++) {
+					const uint8_t *texel = &rgba[((size_t) ys[j] * width + xs[i]) * 4];
+					for (int c = 0; c < 3; c++) {
+						sum[c] += toLinear[texel[c]];
+					}
+					sum[3] += texel[3];
+				}
+			}
+			uint8_t *texel = &result[((size_t) y * w + x) * 4];
+			for (int c = 0; c < 3; c++) {
+				texel[c] = toSrgb(sum[c] / 4.0f);
+			}
+			texel[3] = (uint8_t) ((sum[3] + 2.0f) / 4.0f);
+		}
+	}
+	return result;
+}
+
+// BC1 blocks, or BC3 blocks (alpha block then color block) when alpha is
+// set. Blocks past the edge of small levels repeat the last texels.
+void CookedTexture::compress(const uint8_t *rgba, uint32_t width, uint32_t height,
+							 bool alpha, uint8_t *out) {
+	uint8_t block[64];
+	for (uint32_t by = 0; by < height; by += 4) {
+		for (uint32_t bx = 0; bx < width; bx += 4) {
+			for (uint32_t y = 0; y < 4; y++) {
+				for (uint32_t x = 0; x < 4; x++) {
+					size_t texel = (size_t) std::min(by + y, height - 1) * width +
+								   std::min(bx + x, width - 1);
+					memcpy(&block[(y * 4 + x) * 4], &rgba[texel * 4], 4);
+				}
+			}
+			if (alpha) {
+				encodeAlphaBlock(block, out);
+				out += 8;
+			}
+			encodeColorBlock(block, out);
+			out += 8;
+		}
+	}
+}
+
+// Endpoints on the diagonal of the color bounding box (flipped on the axes
+// that decrease as red grows), inset by 1/16 of the range
+void CookedTexture::encodeColorBlock(const uint8_t *block, uint8_t *out) {
+	int lo[3] = {255, 255, 255};
+	int hi[3] = {0, 0, 0};
+	float mean[3] = {0.0f, 0.0f, 0.0f};
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) {
+			lo[c] = std::min(lo[c], (int) block[i * 4 + c]);
+			hi[c] = std::max(hi[c], (int) block[i * 4 + c]);
+			mean[c] += block[i * 4 + c] / 16.0f;
+		}
+	}
+	float covRG = 0.0f, covRB = 0.0f;
+	for (int i = 0; i < 16; i++) {
+		float r = block[i * 4] - mean[0];
+		covRG += r * (block[i * 4 + 1] - mean[1]);
+		covRB += r * (block[i * 4 + 2] - mean[2]);
+	}
+	if (covRG < 0.0f) std::swap(lo[1], hi[1]);
+	if (covRB < 0.0f) std::swap(lo[2], hi[2]);
+	for (int c = 0; c < 3; c++) {
+		int inset = (hi[c] - lo[c]) / 16;
+		hi[c] -= inset;
+		lo[c] += inset;
+	}
+
+	auto pack = [](const int *rgb) {
+		return (uint16_t) ((((rgb[0] * 31 + 127) / 255) << 11) |
+						   (((rgb[1] * 63 + 127) / 255) << 5) |
+						   ((rgb[2] * 31 + 127) / 255));
+	};
+	auto unpack = [](uint16_t c, int *rgb) {
+		int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+		rgb[0] = (r << 3) | (r >> 2);
+		rgb[1] = (g << 2) | (g >> 4);
+		rgb[2] = (b << 3) | (b >> 2);
+	};
+
+	// c0 > c1 selects the four color mode
+	uint16_t c0 = pack(hi), c1 = pack(lo);
+	if (c0 < c1) std::swap(c0, c1);
+	uint32_t indices = 0;
+	if (c0 != c1) {
+		int palette[4][3];
+		unpack(c0, palette[0]);
+		unpack(c1, palette[1]);
+		for (int c = 0; c < 3; c++) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		for (int i = 0; i < 16; i++) {
+			int best = 0, bestError = INT32_MAX;
+			for (int p = 0; p < 4; p++) {
+				int error = 0;
+				for (int c = 0; c < 3; c++) {
+					int d = block[i * 4 + c] - palette[p][c];
+					error += d * d;
+				}
+				if (error < bestError) {
+					best = p;
+					bestError = error;
+				}
+			}
+			indices |= (uint32_t) best << (2 * i);
+		}
+	}
 
+	out[0] = c0 & 0xff;
+	out[1] = c0 >> 8;
+	out[2] = c1 & 0xff;
+	out[3] = c1 >> 8;
+	for (int b = 0; b < 4; b++) {
+		out[4 + b] = (indices >> (8 * b)) & 0xff;
+	}
+}
 
+// Endpoints at the alpha range, eight values mode
+void CookedTexture::encodeAlphaBlock(const uint8_t *block, uint8_t *out) {
+	int a0 = 0, a1 = 255;
+	for (int i = 0; i < 16; i++) {
+		a0 = std::max(a0, (int) block[i * 4 + 3]);
+		a1 = std::min(a1, (int) block[i * 4 + 3]);
+	}
 
-void Texture::createTextureImage(std::string file) {
-	int texWidth, texHeight, texChannels;
-	stbi_uc* pixels = stbi_load(file.c_str(), &texWidth, &texHeight,
-						&texChannels, STBI_rgb_alpha);
-	if (!pixels) {
-		throw std::runtime_error("failed to load texture image!");
+	uint64_t indices = 0;
+	if (a0 > a1) {
+		int palette[8] = {a0, a1};
+		for (int p = 2; p < 8; p++) {
+			palette[p] = ((8 - p) * a0 + (p - 1) * a1) / 7;
+		}
+		for (int i = 0; i < 16; i++) {
+			int best = 0, bestError = 256;
+			for (int p = 0; p < 8; p++) {
+				int error = std::abs(block[i * 4 + 3] - palette[p]);
+				if (error < bestError) {
+					best = p;
+					bestError = error;
+				}
+			}
+			indices |= (uint64_t) best << (3 * i);
+		}
 	}
 
-	VkDeviceSize imageSize = texWidth * texHeight * 4;
-	mipLevels = static_cast<uint32_t>(std::floor(
-					std::log2(std::max(texWidth, texHeight)))) + 1;
-	
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	 
-	BP->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-	  						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-	  						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-	  						stagingBuffer, stagingBufferMemory);
-	void* data;
-	vkMapMemory(BP->device, stagingBufferMemory, 0, imageSize, 0, &data);
-	memcpy(data, pixels, static_cast<size_t>(imageSize));
-	vkUnmapMemory(BP->device, stagingBufferMemory);
-	
-	stbi_image_free(pixels);
-	
-	BP->createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
-				VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
-				VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
-				textureImageMemory);
-				
-	BP->transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
-	BP->copyBufferToImage(stagingBuffer, textureImage,
-			static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
+	out[0] = (uint8_t) a0;
+	out[1] = (uint8_t) a1;
+	for (int b = 0; b < 6; b++) {
+		out[2 + b] = (indices >> (8 * b)) & 0xff;
+	}
+}
 
-	BP->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-					texWidth, texHeight, mipLevels);
+void Texture::createTextureImage(const CookedTexture &cooked) {
+	format = cooked.vkFormat();
+	mipLevels = cooked.header.mipLevels - residentLevel;
+	createLevels(cooked, residentLevel, BP->uploader, textureImage, textureImageMemory);
+}
 
-	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+// Image with the levels firstLevel.. of cooked, its upload recorded in uploader
+void Texture::createLevels(const CookedTexture &cooked, uint32_t firstLevel,
+						   StagingUploader &uploader, VkImage &image,
+						   MemoryAllocation &memory) {
+	uint32_t levelCount = cooked.header.mipLevels - firstLevel;
+	const TextureCacheLevel &top = cooked.levels[firstLevel];
+
+	// streamed images come and go, linear blocks would never be reset
+	BP->createImage(top.width, top.height, levelCount, cooked.vkFormat(),
+				VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+				VK_IMAGE_USAGE_SAMPLED_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory,
+				BP->streamTextures ? ALLOC_FREE_LIST : ALLOC_LINEAR);
+
+	std::vector<VkBufferImageCopy> regions(levelCount);
+	for (uint32_t i = 0; i < levelCount; i++) {
+		const TextureCacheLevel &level = cooked.levels[firstLevel + i];
+		regions[i].bufferOffset = level.offset - top.offset;
+		regions[i].bufferRowLength = 0;
+		regions[i].bufferImageHeight = 0;
+		regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		regions[i].imageSubresource.mipLevel = i;
+		regions[i].imageSubresource.baseArrayLayer = 0;
+		regions[i].imageSubresource.layerCount = 1;
+		regions[i].imageOffset = {0, 0, 0};
+		regions[i].imageExtent = {level.width, level.height, 1};
+	}
+	uploader.uploadImage(image, cooked.data.data() + top.offset,
+						 cooked.data.size() - top.offset, regions, levelCount);
 }
 
 void Texture::createTextureImageView() {
 	textureImageView = BP->createImageView(textureImage,
-									   VK_FORMAT_R8G8B8A8_SRGB,
+									   format,
 									   VK_IMAGE_ASPECT_COLOR_BIT,
 									   mipLevels);
 }
 	
-void Texture::createTextureSampler() {
+void SamplerCache::init(BaseProject *bp) {
+	BP = bp;
+}
+
+VkSampler SamplerCache::get(const SamplerState &state) {
+	for (auto &sampler : samplers) {
+		if (sampler.first == state) {
+			return sampler.second;
+		}
+	}
+
 	VkSamplerCreateInfo samplerInfo{};
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-	samplerInfo.magFilter = VK_FILTER_LINEAR;
-	samplerInfo.minFilter = VK_FILTER_LINEAR;
-	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.anisotropyEnable = VK_TRUE;
-	samplerInfo.maxAnisotropy = 16;
+	samplerInfo.magFilter = state.filter;
+	samplerInfo.minFilter = state.filter;
+	samplerInfo.addressModeU = state.addressMode;
+	samplerInfo.addressModeV = state.addressMode;
+	samplerInfo.addressModeW = state.addressMode;
+	samplerInfo.anisotropyEnable = state.maxAnisotropy > 1.0f ? VK_TRUE : VK_FALSE;
+	samplerInfo.maxAnisotropy = state.maxAnisotropy;
 	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
 	samplerInfo.unnormalizedCoordinates = VK_FALSE;
 	samplerInfo.compareEnable = VK_FALSE;
@@ -1636,52 +4006,525 @@ void Texture::createTextureSampler() {
 	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
 	samplerInfo.mipLodBias = 0.0f;
 	samplerInfo.minLod = 0.0f;
-	samplerInfo.maxLod = static_cast<float>(mipLevels);
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
 	
+	VkSampler sampler;
 	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr,
-									  &textureSampler);
+									  &sampler);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
 	 	throw std::runtime_error("failed to create texture sampler!");
 	}
+	samplers.push_back({state, sampler});
+	return sampler;
+}
+
+void SamplerCache::cleanup() {
+	for (auto &sampler : samplers) {
+		vkDestroySampler(BP->device, sampler.second, nullptr);
+	}
+	samplers.clear();
 }
-	
 
+void Texture::init(BaseProject *bp, std::string file, const SamplerState &sampler) {
+	CookedTexture cooked;
+	cooked.load(file, bp->textureCompressionBCSupported, bp->maxImageDimension2D);
+	init(bp, cooked, sampler);
+}
 
-void Texture::init(BaseProject *bp, std::string file) {
+void Texture::init(BaseProject *bp, const CookedTexture &cooked,
+				   const SamplerState &sampler) {
 	BP = bp;
-	createTextureImage(file);
+	residentLevel = 0;
+	if (BP->streamTextures) {
+		this->cooked = cooked;
+		while (residentLevel + 1 < cooked.header.mipLevels &&
+			   std::max(cooked.levels[residentLevel].width,
+						cooked.levels[residentLevel].height) > BP->streamInitialSize) {
+			residentLevel++;
+		}
+	}
+	wantedLevel = cooked.header.mipLevels - 1;
+
+	createTextureImage(cooked);
 	createTextureImageView();
-	createTextureSampler();
+	textureSampler = BP->samplers.get(sampler);
+	if (BP->streamTextures) {
+		BP->streamer.add(this);
+	}
+	if (BP->bindlessTextures) {
+		bindlessIndex = BP->textureTable.add(this);
+	}
+}
+
+// Asks for the level with about one texel per pixel on a surface the
+// texture covers, pixels wide on screen. Ignored without streaming.
+void Texture::request(float pixels) {
+	if (!BP->streamTextures) {
+		return;
+	}
+	float size = (float) std::max(cooked.header.width, cooked.header.height);
+	uint32_t level = 0;
+	if (pixels < size) {
+		level = static_cast<uint32_t>(std::floor(std::log2(size / std::max(pixels, 1.0f))));
+	}
+	wantedLevel = std::min(wantedLevel, std::min(level, cooked.header.mipLevels - 1));
 }
 
 void Texture::cleanup() {
-   	vkDestroySampler(BP->device, textureSampler, nullptr);
+	if (BP->streamTextures) {
+		BP->streamer.remove(this);
+	}
+	if (BP->bindlessTextures) {
+		BP->textureTable.remove(this);
+	}
    	vkDestroyImageView(BP->device, textureImageView, nullptr);
 	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+	BP->allocator.free(textureImageMemory);
+}
+
+
+
+
+
+void TextureCache::init(BaseProject *bp) {
+	BP = bp;
+}
+
+std::string TextureCache::key(const std::string &file, const SamplerState &sampler) {
+	return file + "|" + std::to_string(sampler.filter) + "|" +
+		   std::to_string(sampler.addressMode) + "|" + std::to_string(sampler.maxAnisotropy);
+}
+
+Texture *TextureCache::acquire(const std::string &file, const SamplerState &sampler) {
+	return acquire(std::vector<std::string>{file}, sampler)[0];
+}
+
+// The files not loaded yet are read (or cooked) in parallel, then their
+// images are created and their uploads recorded in BP->uploader in list order
+std::vector<Texture *> TextureCache::acquire(const std::vector<std::string> &files,
+											 const SamplerState &sampler) {
+	std::vector<std::string> newKeys;
+	std::vector<const std::string *> newFiles;
+	for (const auto &file : files) {
+		std::string k = key(file, sampler);
+		if (entries[k].users == 0 &&
+				std::find(newKeys.begin(), newKeys.end(), k) == newKeys.end()) {
+			newKeys.push_back(k);
+			newFiles.push_back(&file);
+		}
+	}
+
+	std::vector<CookedTexture> cooked(newFiles.size());
+	size_t created = 0;
+	try {
+		BP->workers.parallelFor((int) newFiles.size(), [&](int i) {
+			cooked[i].load(*newFiles[i], BP->textureCompressionBCSupported,
+						   BP->maxImageDimension2D);
+		});
+		for (; created < newFiles.size(); created++) {
+			entries[newKeys[created]].texture.init(BP, cooked[created], sampler);
+		}
+	} catch (...) {
+		if (created > 0) {
+			// the recorded uploads still reference the images
+			BP->uploader.flush();
+		}
+		for (size_t i = 0; i < newFiles.size(); i++) {
+			if (i < created) {
+				entries[newKeys[i]].texture.cleanup();
+			}
+			entries.erase(newKeys[i]);
+		}
+		throw;
+	}
+
+	std::vector<Texture *> acquired;
+	for (const auto &file : files) {
+		Entry &entry = entries[key(file, sampler)];
+		entry.users++;
+		acquired.push_back(&entry.texture);
+	}
+	return acquired;
+}
+
+void TextureCache::release(Texture *texture) {
+	for (auto it = entries.begin(); it != entries.end(); ++it) {
+		if (&it->second.texture == texture) {
+			if (--it->second.users == 0) {
+				it->second.texture.cleanup();
+				entries.erase(it);
+			}
+			return;
+		}
+	}
+}
+
+// Destroys the textures still acquired
+void TextureCache::cleanup() {
+	for (auto &entry : entries) {
+		entry.second.texture.cleanup();
+	}
+	entries.clear();
+}
+
+void TextureTable::init(BaseProject *bp, uint32_t capacity) {
+	BP = bp;
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	capacity = std::min({capacity, properties.limits.maxPerStageDescriptorSamplers,
+						 properties.limits.maxPerStageDescriptorSampledImages});
+	slots.assign(capacity, nullptr);
+
+	DSL.init(bp, {{0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				   VK_SHADER_STAGE_FRAGMENT_BIT, capacity}});
+
+	uint32_t sets = static_cast<uint32_t>(BP->swapChainImages.size());
+	VkDescriptorPoolSize poolSize{};
+	poolSize.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSize.descriptorCount = capacity * sets;
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	poolInfo.maxSets = sets;
+	VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr,
+											 &descriptorPool);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create texture table pool!");
+	}
+
+	std::vector<VkDescriptorSetLayout> layouts(sets, DSL.descriptorSetLayout);
+	descriptorSets.resize(sets);
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = sets;
+	allocInfo.pSetLayouts = layouts.data();
+	result = vkAllocateDescriptorSets(BP->device, &allocInfo, descriptorSets.data());
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate texture table set!");
+	}
+}
+
+uint32_t TextureTable::add(Texture *texture) {
+	auto slot = std::find(slots.begin(), slots.end(), nullptr);
+	if (slot == slots.end()) {
+		throw std::runtime_error("texture table is full!");
+	}
+	*slot = texture;
+	uint32_t index = static_cast<uint32_t>(slot - slots.begin());
+
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageInfo.imageView = texture->textureImageView;
+	imageInfo.sampler = texture->textureSampler;
+
+	std::vector<VkWriteDescriptorSet> writes(descriptorSets.size());
+	for (size_t i = 0; i < descriptorSets.size(); i++) {
+		writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[i].dstSet = descriptorSets[i];
+		writes[i].dstBinding = 0;
+		writes[i].dstArrayElement = index;
+		writes[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writes[i].descriptorCount = 1;
+		writes[i].pImageInfo = &imageInfo;
+		if (BP->streamTextures) {
+			BP->streamer.bind(texture, static_cast<uint32_t>(i), descriptorSets[i],
+							  0, index);
+		}
+	}
+	vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(writes.size()),
+						   writes.data(), 0, nullptr);
+	return index;
+}
+
+// The slot keeps its stale descriptor: partially bound, it is never read
+void TextureTable::remove(Texture *texture) {
+	auto slot = std::find(slots.begin(), slots.end(), texture);
+	if (slot != slots.end()) {
+		*slot = nullptr;
+	}
+}
+
+void TextureTable::cleanup() {
+	vkDestroyDescriptorPool(BP->device, descriptorPool, nullptr);
+	descriptorSets.clear();
+	DSL.cleanup();
+	slots.clear();
+}
+
+void TextureStreamer::init(BaseProject *bp) {
+	BP = bp;
+	uploader.init(bp, 8 * 1024 * 1024);
+}
+
+void TextureStreamer::add(Texture *texture) {
+	textures.push_back(texture);
+	residentSize += levelsSize(texture, texture->residentLevel);
+}
+
+// Called by Texture::cleanup, drops its pending change, its retired
+// images and its bindings
+void TextureStreamer::remove(Texture *texture) {
+	for (size_t i = 0; i < changes.size(); ) {
+		if (changes[i].texture == texture) {
+			uploader.wait();
+			destroy(changes[i]);
+			changes.erase(changes.begin() + i);
+		} else {
+			i++;
+		}
+	}
+	for (size_t i = 0; i < retired.size(); ) {
+		if (retired[i].texture == texture) {
+			destroy(retired[i]);
+			retired.erase(retired.begin() + i);
+		} else {
+			i++;
+		}
+	}
+	bindings.erase(std::remove_if(bindings.begin(), bindings.end(),
+			[&](const Binding &b) { return b.texture == texture; }), bindings.end());
+	auto it = std::find(textures.begin(), textures.end(), texture);
+	if (it != textures.end()) {
+		residentSize -= levelsSize(texture, texture->residentLevel);
+		textures.erase(it);
+	}
+}
+
+void TextureStreamer::bind(Texture *texture, uint32_t image, VkDescriptorSet set,
+						   uint32_t binding, uint32_t element) {
+	bindings.push_back({texture, image, set, binding, element});
+}
+
+void TextureStreamer::unbind(VkDescriptorSet set) {
+	bindings.erase(std::remove_if(bindings.begin(), bindings.end(),
+			[&](const Binding &b) { return b.set == set; }), bindings.end());
+}
+
+// Once per frame, after the requests
+void TextureStreamer::update() {
+	retire();
+	if (!changes.empty() && uploader.finished()) {
+		apply();
+	}
+	if (changes.empty()) {
+		schedule();
+	}
+	for (Texture *texture : textures) {
+		texture->wantedLevel = texture->cooked.header.mipLevels - 1;
+	}
+}
+
+// Rewrites the stale sets of a swap chain image, once its last frame is
+// done. Returns true if any was, the command buffer of the image must then
+// be recorded again.
+bool TextureStreamer::refresh(uint32_t image) {
+	std::vector<VkDescriptorImageInfo> imageInfos;
+	imageInfos.reserve(bindings.size());
+	std::vector<VkWriteDescriptorSet> writes;
+	for (Binding &binding : bindings) {
+		if (!binding.stale || binding.image != image) {
+			continue;
+		}
+		VkDescriptorImageInfo imageInfo{};
+		imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		imageInfo.imageView = binding.texture->textureImageView;
+		imageInfo.sampler = binding.texture->textureSampler;
+		imageInfos.push_back(imageInfo);
+
+		VkWriteDescriptorSet write{};
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.dstSet = binding.set;
+		write.dstBinding = binding.binding;
+		write.dstArrayElement = binding.element;
+		write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		write.descriptorCount = 1;
+		write.pImageInfo = &imageInfos.back();
+		writes.push_back(write);
+		binding.stale = false;
+	}
+	if (writes.empty()) {
+		return false;
+	}
+	vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(writes.size()),
+						   writes.data(), 0, nullptr);
+	return true;
+}
+
+void TextureStreamer::schedule() {
+	std::vector<Texture *> loads;
+	for (Texture *texture : textures) {
+		if (texture->wantedLevel < texture->residentLevel) {
+			loads.push_back(texture);
+		}
+	}
+	// the ones furthest from their request first
+	std::sort(loads.begin(), loads.end(), [](const Texture *a, const Texture *b) {
+		return a->residentLevel - a->wantedLevel > b->residentLevel - b->wantedLevel;
+	});
+
+	VkDeviceSize used = residentSize;
+	for (Texture *texture : loads) {
+		VkDeviceSize extra = levelsSize(texture, texture->wantedLevel) -
+							 levelsSize(texture, texture->residentLevel);
+		while (used + extra > BP->textureBudget && changes.size() < maxChanges) {
+			Texture *victim = nullptr;
+			VkDeviceSize freed = 0;
+			for (Texture *other : textures) {
+				if (other->wantedLevel <= other->residentLevel || changing(other)) {
+					continue;
+				}
+				VkDeviceSize size = levelsSize(other, other->residentLevel) -
+									levelsSize(other, other->wantedLevel);
+				if (size > freed) {
+					victim = other;
+					freed = size;
+				}
+			}
+			if (victim == nullptr) {
+				break;
+			}
+			start(victim, victim->wantedLevel);
+			used -= freed;
+		}
+		if (used + extra > BP->textureBudget || changes.size() >= maxChanges) {
+			break;
+		}
+		start(texture, texture->wantedLevel);
+		used += extra;
+	}
+	uploader.submit();
+}
+
+void TextureStreamer::start(Texture *texture, uint32_t level) {
+	Change change{};
+	change.texture = texture;
+	change.level = level;
+	texture->createLevels(texture->cooked, level, uploader, change.image, change.memory);
+	change.view = BP->createImageView(change.image, texture->format,
+									  VK_IMAGE_ASPECT_COLOR_BIT,
+									  texture->cooked.header.mipLevels - level);
+	changes.push_back(change);
 }
 
+// Swaps the uploaded images in. The frames in flight may still use the old
+// ones, so they are retired and the sets using them marked for refresh().
+void TextureStreamer::apply() {
+	uploader.wait();
+	for (Change &change : changes) {
+		Texture *texture = change.texture;
+		residentSize += levelsSize(texture, change.level);
+		residentSize -= levelsSize(texture, texture->residentLevel);
+
+		retired.push_back({texture, texture->textureImage, texture->textureImageMemory,
+						   texture->textureImageView, MAX_FRAMES_IN_FLIGHT});
+		texture->textureImage = change.image;
+		texture->textureImageMemory = change.memory;
+		texture->textureImageView = change.view;
+		texture->residentLevel = change.level;
+		texture->mipLevels = texture->cooked.header.mipLevels - change.level;
+
+		for (Binding &binding : bindings) {
+			if (binding.texture == texture) {
+				binding.stale = true;
+			}
+		}
+	}
+	changes.clear();
+}
+
+// Counts down the retired images whose texture has no stale set left: the
+// frames submitted before the last refresh() may still sample them
+void TextureStreamer::retire() {
+	for (size_t i = 0; i < retired.size(); ) {
+		Retired &old = retired[i];
+		if (!stale(old.texture) && --old.frames <= 0) {
+			destroy(old);
+			retired.erase(retired.begin() + i);
+		} else {
+			i++;
+		}
+	}
+}
+
+void TextureStreamer::destroy(Change &change) {
+	vkDestroyImageView(BP->device, change.view, nullptr);
+	vkDestroyImage(BP->device, change.image, nullptr);
+	BP->allocator.free(change.memory);
+}
+
+void TextureStreamer::destroy(Retired &old) {
+	vkDestroyImageView(BP->device, old.view, nullptr);
+	vkDestroyImage(BP->device, old.image, nullptr);
+	BP->allocator.free(old.memory);
+}
+
+bool TextureStreamer::changing(Texture *texture) const {
+	for (const Change &change : changes) {
+		if (change.texture == texture) {
+			return true;
+		}
+	}
+	return false;
+}
 
+bool TextureStreamer::stale(Texture *texture) const {
+	for (const Binding &binding : bindings) {
+		if (binding.texture == texture && binding.stale) {
+			return true;
+		}
+	}
+	return false;
+}
 
+// Bytes of the cooked levels level.. of texture
+VkDeviceSize TextureStreamer::levelsSize(const Texture *texture, uint32_t level) {
+	VkDeviceSize size = 0;
+	for (uint32_t i = level; i < texture->cooked.header.mipLevels; i++) {
+		size += texture->cooked.levels[i].size;
+	}
+	return size;
+}
 
+void TextureStreamer::cleanup() {
+	uploader.wait();
+	for (Change &change : changes) {
+		destroy(change);
+	}
+	changes.clear();
+	for (Retired &old : retired) {
+		destroy(old);
+	}
+	retired.clear();
+	uploader.cleanup();
+}
 
 void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-					std::vector<DescriptorSetLayout *> D) {
+					std::vector<DescriptorSetLayout *> D,
+					std::vector<VkPushConstantRange> PC,
+					bool instanced, PipelinePass pass,
+					std::vector<uint32_t> specialization) {
 	BP = bp;
+	bool depthOnly = pass == DEPTH_PREPASS;
 	
 	auto vertShaderCode = readFile(VertShader);
-	auto fragShaderCode = readFile(FragShader);
-	
 	std::cout << "Vertex shader len: " <<
 				vertShaderCode.size() << "\n";
-	std::cout << "Fragment shader len: " <<
-				fragShaderCode.size() << "\n";
-	
 	VkShaderModule vertShaderModule =
 			createShaderModule(vertShaderCode);
-	VkShaderModule fragShaderModule =
-			createShaderModule(fragShaderCode);
+
+	// the depth prepass has no fragment shader
+	VkShaderModule fragShaderModule = VK_NULL_HANDLE;
+	if (!depthOnly) {
+		auto fragShaderCode = readFile(FragShader);
+		std::cout << "Fragment shader len: " <<
+					fragShaderCode.size() << "\n";
+		fragShaderModule = createShaderModule(fragShaderCode);
+	}
 
 	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
     vertShaderStageInfo.sType =
@@ -1697,6 +4540,23 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
     fragShaderStageInfo.module = fragShaderModule;
     fragShaderStageInfo.pName = "main";
 
+	// specialization[i] is the constant with constant_id = i, in both stages
+	std::vector<VkSpecializationMapEntry> specializationEntries(specialization.size());
+	for (uint32_t i = 0; i < specialization.size(); i++) {
+		specializationEntries[i].constantID = i;
+		specializationEntries[i].offset = i * sizeof(uint32_t);
+		specializationEntries[i].size = sizeof(uint32_t);
+	}
+	VkSpecializationInfo specializationInfo{};
+	specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+	specializationInfo.pMapEntries = specializationEntries.data();
+	specializationInfo.dataSize = specialization.size() * sizeof(uint32_t);
+	specializationInfo.pData = specialization.data();
+	if (!specialization.empty()) {
+		vertShaderStageInfo.pSpecializationInfo = &specializationInfo;
+		fragShaderStageInfo.pSpecializationInfo = &specializationInfo;
+	}
+
     VkPipelineShaderStageCreateInfo shaderStages[] =
     		{vertShaderStageInfo, fragShaderStageInfo};
 
@@ -1704,13 +4564,27 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType =
 			VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	auto bindingDescription = Vertex::getBindingDescription();
-	auto attributeDescriptions = Vertex::getAttributeDescriptions();
+	std::vector<VkVertexInputBindingDescription> bindingDescriptions =
+			{Vertex::getBindingDescription()};
+	auto vertexAttributes = Vertex::getAttributeDescriptions();
+	std::vector<VkVertexInputAttributeDescription> attributeDescriptions(
+			vertexAttributes.begin(), vertexAttributes.end());
+	if (depthOnly) {
+		bindingDescriptions = {Vertex::getPositionBindingDescription()};
+		attributeDescriptions = {Vertex::getPositionAttributeDescription()};
+	}
+	if (instanced) {
+		bindingDescriptions.push_back(InstanceData::getBindingDescription());
+		auto instanceAttributes = InstanceData::getAttributeDescriptions();
+		attributeDescriptions.insert(attributeDescriptions.end(),
+				instanceAttributes.begin(), instanceAttributes.end());
+	}
 			
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
+	vertexInputInfo.vertexBindingDescriptionCount =
+			static_cast<uint32_t>(bindingDescriptions.size());
 	vertexInputInfo.vertexAttributeDescriptionCount =
 			static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
 	vertexInputInfo.pVertexAttributeDescriptions =
 			attributeDescriptions.data();		
 
@@ -1790,8 +4664,8 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 			VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 	colorBlending.logicOpEnable = VK_FALSE;
 	colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-	colorBlending.attachmentCount = 1;
-	colorBlending.pAttachments = &colorBlendAttachment;
+	colorBlending.attachmentCount = depthOnly ? 0 : 1;
+	colorBlending.pAttachments = depthOnly ? nullptr : &colorBlendAttachment;
 	colorBlending.blendConstants[0] = 0.0f; // Optional
 	colorBlending.blendConstants[1] = 0.0f; // Optional
 	colorBlending.blendConstants[2] = 0.0f; // Optional
@@ -1808,8 +4682,8 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutInfo.setLayoutCount = DSL.size();
 	pipelineLayoutInfo.pSetLayouts = DSL.data();
-	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-	pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+	pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(PC.size());
+	pipelineLayoutInfo.pPushConstantRanges = PC.empty() ? nullptr : PC.data();
 	
 	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
 				&pipelineLayout);
@@ -1825,6 +4699,13 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	depthStencil.depthTestEnable = VK_TRUE;
 	depthStencil.depthWriteEnable = VK_TRUE;
 	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+	if (BP->depthPrepass && pass == COLOR_PASS_PREPASSED) {
+		// only the visible surface matches the prepass depth exactly
+		depthStencil.depthWriteEnable = VK_FALSE;
+		depthStencil.depthCompareOp = VK_COMPARE_OP_EQUAL;
+	} else if (BP->depthPrepass && pass == COLOR_PASS) {
+		depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	}
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.minDepthBounds = 0.0f; // Optional
 	depthStencil.maxDepthBounds = 1.0f; // Optional
@@ -1835,7 +4716,7 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	VkGraphicsPipelineCreateInfo pipelineInfo{};
 	pipelineInfo.sType =
 			VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
+	pipelineInfo.stageCount = depthOnly ? 1 : 2;
 	pipelineInfo.pStages = shaderStages;
 	pipelineInfo.pVertexInputState = &vertexInputInfo;
 	pipelineInfo.pInputAssemblyState = &inputAssembly;
@@ -1847,18 +4728,20 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	pipelineInfo.pDynamicState = nullptr; // Optional
 	pipelineInfo.layout = pipelineLayout;
 	pipelineInfo.renderPass = BP->renderPass;
-	pipelineInfo.subpass = 0;
+	pipelineInfo.subpass = depthOnly ? 0 : BP->colorSubpass();
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 	
-	result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
+	result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache, 1,
 			&pipelineInfo, nullptr, &graphicsPipeline);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
 		throw std::runtime_error("failed to create graphics pipeline!");
 	}
 	
-	vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
+	if (fragShaderModule != VK_NULL_HANDLE) {
+		vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
+	}
 	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
 }
 
@@ -1899,6 +4782,106 @@ VkShaderModule Pipeline::createShaderModule(const std::vector<char>& code) {
 	return shaderModule;
 }
 
+void PipelineVariants::init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
+							std::vector<DescriptorSetLayout *> D,
+							std::vector<VkPushConstantRange> PC,
+							bool instanced, PipelinePass pass) {
+	BP = bp;
+	vertShader = VertShader;
+	fragShader = FragShader;
+	this->D = D;
+	this->PC = PC;
+	this->instanced = instanced;
+	this->pass = pass;
+}
+
+Pipeline &PipelineVariants::get(uint32_t features) {
+	auto found = variants.find(features);
+	if (found != variants.end()) {
+		return found->second;
+	}
+
+	std::vector<uint32_t> specialization(MATERIAL_FEATURE_COUNT);
+	for (uint32_t i = 0; i < MATERIAL_FEATURE_COUNT; i++) {
+		specialization[i] = (features >> i) & 1;
+	}
+	Pipeline &P = variants[features];
+	P.init(BP, vertShader, fragShader, D, PC, instanced, pass, specialization);
+	return P;
+}
+
+void PipelineVariants::cleanup() {
+	for (auto &variant : variants) {
+		variant.second.cleanup();
+	}
+	variants.clear();
+}
+
+void ComputePipeline::init(BaseProject *bp, const std::string& ComputeShader,
+						   std::vector<DescriptorSetLayout *> D,
+						   std::vector<VkPushConstantRange> PC) {
+	BP = bp;
+
+	auto compShaderCode = Pipeline::readFile(ComputeShader);
+	std::cout << "Compute shader len: " << compShaderCode.size() << "\n";
+
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = compShaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(compShaderCode.data());
+
+	VkShaderModule compShaderModule;
+	VkResult result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr,
+										   &compShaderModule);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	std::vector<VkDescriptorSetLayout> DSL(D.size());
+	for(int i = 0; i < D.size(); i++) {
+		DSL[i] = D[i]->descriptorSetLayout;
+	}
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = DSL.size();
+	pipelineLayoutInfo.pSetLayouts = DSL.data();
+	pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(PC.size());
+	pipelineLayoutInfo.pPushConstantRanges = PC.empty() ? nullptr : PC.data();
+
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+									&pipelineLayout);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline layout!");
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = compShaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	pipelineInfo.basePipelineIndex = -1;
+
+	result = vkCreateComputePipelines(BP->device, BP->pipelineCache, 1,
+									  &pipelineInfo, nullptr, &computePipeline);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline!");
+	}
+
+	vkDestroyShaderModule(BP->device, compShaderModule, nullptr);
+}
+
+void ComputePipeline::cleanup() {
+	vkDestroyPipeline(BP->device, computePipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+}
+
 void Pipeline::cleanup() {
 		vkDestroyPipeline(BP->device, graphicsPipeline, nullptr);
 		vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
@@ -1909,16 +4892,28 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
 	
 	std::vector<VkDescriptorSetLayoutBinding> bindings;
 	bindings.resize(B.size());
+	std::vector<VkDescriptorBindingFlagsEXT> bindingFlags(B.size(), 0);
+	bool arrays = false;
 	for(int i = 0; i < B.size(); i++) {
 		bindings[i].binding = B[i].binding;
 		bindings[i].descriptorType = B[i].type;
-		bindings[i].descriptorCount = 1;
+		bindings[i].descriptorCount = B[i].count;
 		bindings[i].stageFlags = B[i].flags;
 		bindings[i].pImmutableSamplers = nullptr;
+		if (B[i].count > 1) {
+			bindingFlags[i] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+			arrays = true;
+		}
 	}
 	
+	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flagsInfo{};
+	flagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+	flagsInfo.bindingCount = static_cast<uint32_t>(bindingFlags.size());
+	flagsInfo.pBindingFlags = bindingFlags.data();
+
 	VkDescriptorSetLayoutCreateInfo layoutInfo{};
 	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.pNext = arrays ? &flagsInfo : nullptr;
 	layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());;
 	layoutInfo.pBindings = bindings.data();
 	
@@ -1941,18 +4936,32 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 	// Create uniform buffer
 	uniformBuffers.resize(E.size());
 	uniformBuffersMemory.resize(E.size());
+	uniformBuffersMapped.resize(E.size());
 	toFree.resize(E.size());
 
 	for (int j = 0; j < E.size(); j++) {
 		uniformBuffers[j].resize(BP->swapChainImages.size());
 		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
-		if(E[j].type == UNIFORM) {
+		uniformBuffersMapped[j].resize(BP->swapChainImages.size(), nullptr);
+		if((E[j].type == UNIFORM || E[j].type == STORAGE) && E[j].buffers != nullptr) {
+			// buffers owned by someone else
+			uniformBuffers[j] = *E[j].buffers;
+			toFree[j] = false;
+		} else if(E[j].type == UNIFORM || E[j].type == STORAGE) {
+			VkBufferUsageFlags usage = E[j].type == UNIFORM ?
+										VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT :
+										VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
 				VkDeviceSize bufferSize = E[j].size;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				BP->createBuffer(bufferSize, usage,
 									 	 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 									 	 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 									 	 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+				// host visible blocks are mapped once by the allocator
+				uniformBuffersMapped[j][i] = uniformBuffersMemory[j][i].mapped;
+				if (uniformBuffersMapped[j][i] == nullptr) {
+					throw std::runtime_error("uniform buffer is not host mapped!");
+				}
 			}
 			toFree[j] = true;
 		} else {
@@ -1961,15 +4970,25 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 	}
 	
 	// Create Descriptor set
-	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
+	// Without per image uniform buffers all the images can share one set,
+	// unless it has streamed textures: those are rewritten per image
+	bool perImage = false;
+	for (int j = 0; j < E.size(); j++) {
+		perImage = perImage || (E[j].type == UNIFORM) || (E[j].type == STORAGE) ||
+				   (E[j].type == TEXTURE && BP->streamTextures);
+	}
+	uint32_t setCount = perImage ?
+						static_cast<uint32_t>(BP->swapChainImages.size()) : 1;
+
+	std::vector<VkDescriptorSetLayout> layouts(setCount,
 											   DSL->descriptorSetLayout);
 	VkDescriptorSetAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocInfo.descriptorPool = BP->descriptorPool;
-	allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
+	allocInfo.descriptorSetCount = setCount;
 	allocInfo.pSetLayouts = layouts.data();
 	
-	descriptorSets.resize(BP->swapChainImages.size());
+	descriptorSets.resize(setCount);
 	
 	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
 										descriptorSets.data());
@@ -1978,24 +4997,44 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 		throw std::runtime_error("failed to allocate descriptor sets!");
 	}
 	
-	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+	for (size_t i = 0; i < setCount; i++) {
 		std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
+		// the infos must outlive vkUpdateDescriptorSets
+		std::vector<VkDescriptorBufferInfo> bufferInfos(E.size());
+		std::vector<VkDescriptorImageInfo> imageInfos(E.size());
 		for (int j = 0; j < E.size(); j++) {
-			if(E[j].type == UNIFORM) {
-				VkDescriptorBufferInfo bufferInfo{};
+			if(E[j].type == UNIFORM || E[j].type == STORAGE) {
+				VkDescriptorBufferInfo &bufferInfo = bufferInfos[j];
 				bufferInfo.buffer = uniformBuffers[j][i];
 				bufferInfo.offset = 0;
-				bufferInfo.range = E[j].size;
+				bufferInfo.range = E[j].size > 0 ? E[j].size : VK_WHOLE_SIZE;
+				
+				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				descriptorWrites[j].dstSet = descriptorSets[i];
+				descriptorWrites[j].dstBinding = E[j].binding;
+				descriptorWrites[j].dstArrayElement = 0;
+				descriptorWrites[j].descriptorType = E[j].type == UNIFORM ?
+											VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER :
+											VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+				descriptorWrites[j].descriptorCount = 1;
+				descriptorWrites[j].pBufferInfo = &bufferInfo;
+			} else if(E[j].type == DYNAMIC_UNIFORM) {
+				// the offset of the slot is given when the set is bound
+				VkDescriptorBufferInfo &bufferInfo = bufferInfos[j];
+				bufferInfo.buffer = E[j].dynamic->buffer;
+				bufferInfo.offset = 0;
+				bufferInfo.range = E[j].dynamic->elementSize;
 				
 				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 				descriptorWrites[j].dstSet = descriptorSets[i];
 				descriptorWrites[j].dstBinding = E[j].binding;
 				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+				descriptorWrites[j].descriptorType =
+											VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 				descriptorWrites[j].descriptorCount = 1;
 				descriptorWrites[j].pBufferInfo = &bufferInfo;
 			} else if(E[j].type == TEXTURE) {
-				VkDescriptorImageInfo imageInfo{};
+				VkDescriptorImageInfo &imageInfo = imageInfos[j];
 				imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 				imageInfo.imageView = E[j].tex->textureImageView;
 				imageInfo.sampler = E[j].tex->textureSampler;
@@ -2008,6 +5047,10 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 											VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 				descriptorWrites[j].descriptorCount = 1;
 				descriptorWrites[j].pImageInfo = &imageInfo;
+				if (BP->streamTextures) {
+					BP->streamer.bind(E[j].tex, static_cast<uint32_t>(i),
+									  descriptorSets[i], E[j].binding);
+				}
 			}
 		}		
 		vkUpdateDescriptorSets(BP->device,
@@ -2015,14 +5058,67 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 						descriptorWrites.data(), 0, nullptr);
 	}
 
+	// descriptorSets[currentImage] stays valid for a shared set
+	VkDescriptorSet first = descriptorSets[0];
+	descriptorSets.resize(BP->swapChainImages.size(), first);
+}
+
+void DynamicUniformBuffer::init(BaseProject *bp, VkDeviceSize size, uint32_t maxElements) {
+	BP = bp;
+	elementSize = size;
+	capacity = maxElements;
+	count = 0;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	VkDeviceSize alignment = std::max<VkDeviceSize>(1,
+								properties.limits.minUniformBufferOffsetAlignment);
+	stride = (elementSize + alignment - 1) / alignment * alignment;
+
+	BP->createBuffer(stride * capacity * BP->swapChainImages.size(),
+					 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 buffer, bufferMemory);
+	if (bufferMemory.mapped == nullptr) {
+		throw std::runtime_error("dynamic uniform buffer is not host mapped!");
+	}
+	shadow.assign(stride * capacity, 0);
+}
+
+uint32_t DynamicUniformBuffer::allocate() {
+	if (count >= capacity) {
+		throw std::runtime_error("dynamic uniform buffer is full!");
+	}
+	return count++;
+}
+
+void DynamicUniformBuffer::upload(int currentImage) {
+	memcpy(bufferMemory.mapped + offset(currentImage, 0), shadow.data(),
+		   (size_t) (count * stride));
+}
+
+void DynamicUniformBuffer::upload(int currentImage, uint32_t i) {
+	memcpy(bufferMemory.mapped + offset(currentImage, i), slot(i),
+		   (size_t) elementSize);
+}
+
+void DynamicUniformBuffer::cleanup() {
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->allocator.free(bufferMemory);
 }
 
 void DescriptorSet::cleanup() {
+	if (BP->streamTextures) {
+		for (VkDescriptorSet set : descriptorSets) {
+			BP->streamer.unbind(set);
+		}
+	}
 	for(int j = 0; j < uniformBuffers.size(); j++) {
 		if(toFree[j]) {
 			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
 				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
+				BP->allocator.free(uniformBuffersMemory[j][i]);
 			}
 		}
 	}
@@ -2,16 +2,69 @@
 
 const std::string MODEL_PATH = "models/";
 const std::string TEXTURE_PATH = "textures/";
-
-// The uniform buffer object used in this example
-struct UniformBufferObject
+// every texture of the scene, in the order localInit loads them
+const std::vector<std::string> SCENE_TEXTURES = {
+	"terra.png", "wood_door.jpg", "wood_door_flip.jpg", "muro_rosso.jpg",
+	"trak_tile_red.jpg", "CopperKey.png", "GoldKey.png", "Lever.png",
+	"DoorSide2.png", "end.png"};
+
+// The uniform buffer objects used in this example:
+// camera and light, written once per frame (set 0), read by the vertex
+// and fragment stages
+struct GlobalUniformBufferObject
 {
-	alignas(16) glm::mat4 model;
-	alignas(16) glm::mat4 view;
-	alignas(16) glm::mat4 proj;
+	alignas(16) glm::mat4 viewProj;	// proj * view
 	alignas(16) glm::vec3 eyePos;
 	alignas(16) glm::vec3 lightDir;
-	alignas(16) glm::vec3 refl;
+};
+
+// per object data, a slot of the dynamic uniform buffer (set 2)
+struct ObjectUniformBufferObject
+{
+	alignas(16) glm::mat4 model;
+};
+
+// per object data of static objects, pushed when the draw is recorded.
+// The other objects push only textureIndex.
+struct PushConstantObject
+{
+	alignas(16) glm::mat4 model;
+	uint32_t textureIndex;	// in the bindless texture array
+};
+
+// per object data of the GPU driven path (std430), one per object in a
+// storage buffer read by cull.comp and by shader_gpu.vert
+struct ObjectRecord
+{
+	alignas(16) glm::mat4 model;
+	alignas(16) glm::vec4 bbMin;	// local space bounding box
+	alignas(16) glm::vec4 bbMax;
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	int32_t vertexOffset;
+	uint32_t group;			// draw group, index of its counter
+	uint32_t firstCommand;	// first command of the group
+	uint32_t textureIndex;	// in the bindless texture array
+	uint32_t padding[2];
+};
+
+class SceneObject;
+
+// objects whose meshes are copies of the same mesh moved somewhere else,
+// drawn by one instanced call
+struct InstanceBatch
+{
+	std::vector<SceneObject *> members;	// the first one gives mesh and texture
+	uint32_t firstInstance;
+};
+
+// objects sharing a texture and material features, drawn by one indirect call
+struct DrawGroup
+{
+	uint32_t firstCommand;
+	uint32_t maxCount;
+	uint32_t features;	// MaterialFeature bits, select the PGpu variant
+	Texture *texture;	// gives the set of the group, when not bindless
 };
 
 class Loader
@@ -20,9 +73,24 @@ public:
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
-	// Load all objects in file
-	Loader(std::string file)
+	// Meshes built on a cache miss, the mapped cache is used otherwise
+	std::vector<Model> meshes;
+	MeshCache cache;
+
+	// Load all objects in file, from its binary cache when it is up to date.
+	// On a miss every shape is built in one pass, spread over workers if given.
+	Loader(std::string file, WorkerPool *workers = nullptr)
 	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		std::string cacheFile = file + ".cache";
+
+		if (cache.open(cacheFile, file))
+		{
+			std::cout << "Using mesh cache " << cacheFile << std::endl;
+			printTime("cache map", startTime);
+			return;
+		}
+
 		std::cout << "Trying to open " << file << std::endl;
 		std::string warn, err;
 
@@ -31,60 +99,114 @@ public:
 		{
 			throw std::runtime_error(warn + err);
 		}
-	}
+		auto parseTime = printTime("obj parse", startTime);
 
-	void loadModelFromIndex(Model &model, int objIndex)
-	{
-		std::cout << "*****************SHAPES******************" << std::endl;
-		tinyobj::shape_t shape = shapes[objIndex];
-		std::cout << shape.name << std::endl;
-		
-		for (const auto &index : shape.mesh.indices)
+		meshes.resize(shapes.size());
+		auto build = [this](int i) { meshes[i].loadShape(attrib, shapes[i]); };
+		if (workers != nullptr)
 		{
-			Vertex vertex{};
-
-			vertex.pos = {
-				attrib.vertices[3 * index.vertex_index + 0],
-				attrib.vertices[3 * index.vertex_index + 1],
-				attrib.vertices[3 * index.vertex_index + 2]};
-
-			if (attrib.texcoords.size() > 0 && index.texcoord_index != -1)
-			{
-				vertex.texCoord = {
-					attrib.texcoords[2 * index.texcoord_index + 0],
-					1 - attrib.texcoords[2 * index.texcoord_index + 1]};
-			}
-			else
+			workers->parallelFor(static_cast<int>(shapes.size()), build);
+		}
+		else
+		{
+			for (int i = 0; i < (int)shapes.size(); i++)
 			{
-				vertex.texCoord = {0.0f, 0.0f};
+				build(i);
 			}
+		}
 
-			vertex.norm = {
-				attrib.normals[3 * index.normal_index + 0],
-				attrib.normals[3 * index.normal_index + 1],
-				attrib.normals[3 * index.normal_index + 2]};
+		size_t corners = 0, vertices = 0;
+		std::vector<std::string> names;
+		for (size_t i = 0; i < shapes.size(); i++)
+		{
+			names.push_back(shapes[i].name);
+			corners += shapes[i].mesh.indices.size();
+			vertices += meshes[i].vertices.size();
+		}
+		std::cout << "Vertices: " << corners << " -> " << vertices << std::endl;
+		printTime("mesh build", parseTime);
 
-			model.vertices.push_back(vertex);
-			model.indices.push_back(model.vertices.size() - 1);
+		if (!MeshCache::write(cacheFile, file, names, meshes))
+		{
+			std::cout << "Could not write mesh cache " << cacheFile << std::endl;
 		}
 	}
+
+	Loader(const Loader &) = delete;
+
+	~Loader()
+	{
+		cache.close();
+	}
+
+	std::chrono::high_resolution_clock::time_point printTime(const char *phase,
+			std::chrono::high_resolution_clock::time_point since)
+	{
+		auto now = std::chrono::high_resolution_clock::now();
+		std::cout << "Loader " << phase << ": "
+				  << std::chrono::duration<float, std::chrono::milliseconds::period>(now - since).count()
+				  << " ms" << std::endl;
+		return now;
+	}
+
+	// View of a shape's mesh, valid as long as the loader is alive
+	MeshView shapeView(int objIndex)
+	{
+		if (cache.isOpen())
+		{
+			return cache.view(objIndex);
+		}
+		const Model &mesh = meshes[objIndex];
+		return {shapes[objIndex].name.c_str(),
+				mesh.vertices.data(), static_cast<uint32_t>(mesh.vertices.size()),
+				mesh.indices.data(), static_cast<uint32_t>(mesh.indices.size())};
+	}
+
+	void loadModelFromIndex(Model &model, int objIndex)
+	{
+		MeshView view = shapeView(objIndex);
+		std::cout << "Shape " << objIndex << ": " << view.name << std::endl;
+		model.loadView(view);
+	}
 };
 
 class SceneObject
 {
 public:
 	Model model;
-	Texture texture;
-	DescriptorSet DS;
+	Texture *texture;	// owned by BaseProject::textures
 	glm::vec3 position;
 	glm::vec3 rotationAxis;
 	float rotation;
 	glm::mat4 matrix;
+	uint32_t uniformSlot;	// slot in the dynamic uniform buffer
+	// static objects have no slot: model matrix and flags are push constants
+	bool pushConstants = false;
+	uint32_t materialFeatures = 0;	// MaterialFeature bits, select the pipeline variant
+	uint32_t recordIndex;	// index of its ObjectRecord (GPU driven path)
+	// render queue sort ids: same texture, same material; same mesh range, same mesh
+	uint32_t materialId = 0;
+	uint32_t meshId = 0;
+	int shapeIndex;			// shape of the loader it was built from
+	// instanced objects: slot in the instance buffers, and translation from
+	// the mesh of the first object of the batch to their own (-1: not instanced)
+	int instanceSlot = -1;
+	glm::vec3 instanceOffset = glm::vec3(0.0f);
+	// bit i set: the slot of swap chain image i is out of date
+	uint32_t staleImages = ~0u;
+
+	// to be called whenever matrix changes
+	void markDirty() { staleImages = ~0u; }
 	int x; 
 	int y;
 
-	void init(BaseProject *bp, DescriptorSetLayout *DSL1, Loader &loader, int index, Texture &text);
-	void init(BaseProject *bp, DescriptorSetLayout *DSL1, Loader &loader, int index, Texture &text, 
+	// Static objects (no objectUniforms) have no mesh: batchStaticObjects
+	// merges their loader shape into chunks. Moving objects load their mesh,
+	// MyProject::uploadModels adds it to the geometry once the instance
+	// batches are known. No object has a set of its own: the draws bind the
+	// set of their texture (or the texture table) and the shared object set.
+	void init(BaseProject *bp, DynamicUniformBuffer *objectUniforms, Loader &loader, int index, Texture *text);
+	void init(BaseProject *bp, DynamicUniformBuffer *objectUniforms, Loader &loader, int index, Texture *text, 
 	glm::vec3 pos, glm::vec3 rotAxis, float rot);
 
 	void cleanup();
@@ -98,10 +220,10 @@ public:
 	bool active;
 	bool set;
 
-	void init(BaseProject *bp, DescriptorSetLayout *DSL1, Loader &loader, int index, Texture &text, 
+	void init(BaseProject *bp, DynamicUniformBuffer *objectUniforms, Loader &loader, int index, Texture *text, 
 	glm::vec3 pos, glm::vec3 rotAxis, float rot, SceneObject* act) 
 	{
-		SceneObject::init(bp, DSL1, loader, index, text, pos, rotAxis, rot);
+		SceneObject::init(bp, objectUniforms, loader, index, text, pos, rotAxis, rot);
 		activate = act;     // door linked to the interactable object
 		active = false;     // interactable object has been used
 		set = false;
@@ -115,33 +237,47 @@ public:
     // true if the player has collected the key
 	bool hasKey = false;
 
-	void init(BaseProject *bp, DescriptorSetLayout *DSL1, Loader &loader, int index, Texture &text, 
+	void init(BaseProject *bp, DynamicUniformBuffer *objectUniforms, Loader &loader, int index, Texture *text, 
 	glm::vec3 pos, SceneObject* act) 
 	{
-		SceneObject::init(bp, DSL1, loader, index, text, pos, glm::vec3(0.0f), 0.0f);
+		SceneObject::init(bp, objectUniforms, loader, index, text, pos, glm::vec3(0.0f), 0.0f);
 		activate = act;     // door linked to the keyhole
 		active = false;     // key has been used to open the door
 		set = false;
 	}
 };
 
-void SceneObject::init(BaseProject *bp, DescriptorSetLayout *DSL1, Loader &loader, int index, Texture &text)
+void SceneObject::init(BaseProject *bp, DynamicUniformBuffer *objectUniforms, Loader &loader, int index, Texture *text)
 {
-	loader.loadModelFromIndex(model, index);
-	model.init(bp, "");
+	shapeIndex = index;
 	texture = text;
-	DS.init(bp, DSL1, {{0, UNIFORM, sizeof(UniformBufferObject), nullptr}, {1, TEXTURE, 0, &texture}});
+	if (objectUniforms == nullptr)
+	{
+		pushConstants = true;
+	}
+	else
+	{
+		loader.loadModelFromIndex(model, index);
+		uniformSlot = objectUniforms->allocate();
+	}
     // transformation matrix
 	matrix = glm::mat4(1.0f);
 }
 
-void SceneObject::init(BaseProject *bp, DescriptorSetLayout *DSL1, Loader &loader, int index, Texture &text, 
+void SceneObject::init(BaseProject *bp, DynamicUniformBuffer *objectUniforms, Loader &loader, int index, Texture *text, 
 	glm::vec3 pos, glm::vec3 rotAxis, float rot)
 {
-	loader.loadModelFromIndex(model, index);
-	model.init(bp, "");
+	shapeIndex = index;
 	texture = text;
-	DS.init(bp, DSL1, {{0, UNIFORM, sizeof(UniformBufferObject), nullptr}, {1, TEXTURE, 0, &texture}});
+	if (objectUniforms == nullptr)
+	{
+		pushConstants = true;
+	}
+	else
+	{
+		loader.loadModelFromIndex(model, index);
+		uniformSlot = objectUniforms->allocate();
+	}
 	position = pos; // starting position
 	rotationAxis = rotAxis; // axis used for object rotation
 	rotation = rot; // angle of rotation
@@ -150,8 +286,6 @@ void SceneObject::init(BaseProject *bp, DescriptorSetLayout *DSL1, Loader &loade
 
 void SceneObject::cleanup()
 {
-	DS.cleanup();
-	texture.cleanup();
 	model.cleanup();
 }
 
@@ -162,10 +296,14 @@ protected:
 	// Here you list all the Vulkan objects you need:
 
 	// Descriptor Layouts [what will be passed to the shaders]
-	DescriptorSetLayout DSL1;
+	DescriptorSetLayout DSLGlobal;
+	DescriptorSetLayout DSLTexture;	// set 1 without bindless textures
+	DescriptorSetLayout DSLObject;
 
 	// Pipelines [Shader couples]
-	Pipeline P1;
+	PipelineVariants P1;
+	PipelineVariants P2;	// static objects, per object data as push constants
+	Pipeline PDepth;	// depth prepass of the static objects
 
 	// Models, textures and Descriptors (values assigned to the uniforms)
 	SceneObject copperKey;
@@ -188,24 +326,68 @@ protected:
 	SceneObject wallS;
 	SceneObject ceiling;
 	SceneObject endPlane;
-	std::vector<SceneObject> allObjects;
+	std::vector<SceneObject*> sceneObjects;	// all the objects above
+	std::vector<SceneObject*> allObjects;	// the objects that are drawn
+	// Static objects merged by texture and map region (see batchStaticObjects)
+	std::vector<SceneObject> staticChunks;
+	const int chunkSize = 6;	// map cells on each side of a chunk
 	std::vector<Interactable*> interactables;
 	std::vector<KeyHole*> keyHoles;
 
-	Texture floorTexture;
-	Texture doorTexture;
-	Texture doorFlipTexture;
-	Texture wallTexture;
-	Texture ceilingTexture;
-	Texture copperKeyTexture;
-	Texture goldKeyTexture;
-	Texture leverTexture;
-	Texture doorSideTexture;
-	Texture endTexture;
+	// Camera and light uniforms, and the per object uniforms of all the objects
+	DescriptorSet globalDS;
+	DynamicUniformBuffer objectUniforms;
+	DescriptorSet objectDS;	// the slot is selected by the dynamic offset
+
+	// Textures of SCENE_TEXTURES. Without bindless textures each one has a
+	// set, shared by all the draws using it.
+	std::vector<Texture *> sceneTextures;
+	std::vector<DescriptorSet> textureSets;
+
+	// Instanced draws of repeated props (CPU path only)
+	PipelineVariants PInst;
+	std::vector<InstanceBatch> instanceBatches;
+	std::vector<VkBuffer> instanceBuffers;
+	std::vector<MemoryAllocation> instanceBuffersMemory;
+
+	// GPU driven path: cull.comp culls the objects and writes the indirect
+	// commands, then one indirect draw for each group of objects sharing a texture.
+	// Set it in setWindowParameters, it falls back to the CPU path without
+	// drawIndirectFirstInstance.
+	bool gpuDriven = false;
+	// The textures of BaseProject::textureTable are bound once per command
+	// buffer and indexed with per draw values: there are no texture sets and
+	// the draw groups only split by features
+	bool bindless = false;
+	DescriptorSetLayout DSLGpu;
+	DescriptorSetLayout DSLCull;
+	PipelineVariants PGpu;
+	ComputePipeline PCull;
+	DescriptorSet gpuDS;	// camera and object records
+	DescriptorSet cullDS;	// camera, object records, commands and counters
+	std::vector<DrawGroup> drawGroups;
+	std::vector<VkBuffer> indirectBuffers;
+	std::vector<MemoryAllocation> indirectBuffersMemory;
+	std::vector<VkBuffer> countBuffers;
+	std::vector<MemoryAllocation> countBuffersMemory;
+
+	Texture *floorTexture;
+	Texture *doorTexture;
+	Texture *doorFlipTexture;
+	Texture *wallTexture;
+	Texture *ceilingTexture;
+	Texture *copperKeyTexture;
+	Texture *goldKeyTexture;
+	Texture *leverTexture;
+	Texture *doorSideTexture;
+	Texture *endTexture;
 	
 	// Lights
 	glm::vec3 torchLightDir;
 
+	// Camera frustum of the current frame, used for culling
+	Frustum frustum;
+
 	char map[24][25] = {	
 		{'*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*'},
 		{'*','*','*','*','*','*','*','*','*','*','*','*','*','*','*','*',' ',' ','*','*','*','*','*','*'},
@@ -236,6 +418,8 @@ protected:
 	int mapWidth = 25;
 	int mapHeight = 24;
 
+	const float farPlane = 10.0f;	// of the projection, also the render queue depth range
+
     // collision variables
 	const float checkRadius = 0.15; //max distance from walls
 	const int checkSteps = 12;
@@ -251,112 +435,656 @@ protected:
 		windowTitle = "Dungeon";
 		initialBackgroundColor = {0.0f, 0.0f, 0.0f, 1.0f};
 
-		// Descriptor pool sizes
-		uniformBlocksInPool = 20;
-		texturesInPool = 20;
-		setsInPool = 20;
+		// draws are recorded every frame, culled against the camera
+		// and split among the worker threads
+		recordEveryFrame = true;
+		recordInParallel = true;
+
+		// or cull and write the draws with cull.comp and record them once:
+		// the CPU culling, the instanced draws and the render queue are then
+		// not used
+		gpuDriven = false;
+
+		// walls, floor and ceiling write depth first, so the lighting in
+		// frag.spv runs once per pixel for them (CPU path only)
+		depthPrepass = !gpuDriven;
+
+		// texture levels follow what the camera sees, within 32 MB
+		streamTextures = true;
+		textureBudget = 32 * 1024 * 1024;
+
+		// one texture array bound once per command buffer instead of a set
+		// per texture, where supported
+		bindlessTextures = true;
+
+		// Descriptor pool sizes: the camera and object sets, a set for each
+		// texture (unless they turn out bindless) and, on the GPU driven
+		// path, the sets of the object records and of cull.comp
+		int textureCount = static_cast<int>(SCENE_TEXTURES.size());
+		uniformBlocksInPool = gpuDriven ? 3 : 1;
+		dynamicUniformBlocksInPool = 1;
+		storageBuffersInPool = gpuDriven ? 4 : 0;
+		texturesInPool = textureCount;
+		setsInPool = (gpuDriven ? 4 : 2) + textureCount;
 	}
 
 	// Load and setup of your Vulkan objects
 	void localInit()
 	{
 		// Descriptor Layouts [what will be passed to the shaders]
-		DSL1.init(this, {// this array contains the binding:
+		DSLGlobal.init(this, {// this array contains the binding:
 						 // first  element : the binding number
 						 // second element : the time of element (buffer or texture)
 						 // third  element : the pipeline stage where it will be used
-						 {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT},
-						 {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}});
+						 {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT}});
+		DSLTexture.init(this, {{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}});
+		DSLObject.init(this, {{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT}});
+
+		// Culling and draw commands move to the GPU when indirect draws can
+		// select the object record with firstInstance. The command buffers
+		// then stay valid for any camera and are recorded only once.
+		if (gpuDriven && !drawIndirectFirstInstanceSupported)
+		{
+			std::cout << "drawIndirectFirstInstance not supported, culling on the CPU" << std::endl;
+			gpuDriven = false;
+		}
+		// set 1 of every draw: the texture table, or the set of one texture
+		bindless = bindlessTextures;
+		DescriptorSetLayout *textureDSL = bindless ? &textureTable.DSL : &DSLTexture;
+		std::string fragShader = bindless ? "shaders/frag_bindless.spv" : "shaders/frag.spv";
+		// the same range in all the layouts of the CPU path, so that sets 0
+		// and 1 stay bound when the pipeline changes
+		std::vector<VkPushConstantRange> pushConstants = {{VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstantObject)}};
 
 		// Pipelines [Shader couples]
 		// The last array, is a vector of pointer to the layouts of the sets that will
 		// be used in this pipeline. The first element will be set 0, and so on..
-		P1.init(this, "shaders/vert.spv", "shaders/frag.spv", {&DSL1});
+		P1.init(this, "shaders/vert.spv", fragShader, {&DSLGlobal, textureDSL, &DSLObject}, pushConstants);
+		P2.init(this, "shaders/vert_pc.spv", fragShader, {&DSLGlobal, textureDSL}, pushConstants,
+				false, COLOR_PASS_PREPASSED);
+		// the variants are created by createPipelineVariants once the objects are loaded
+		if (depthPrepass)
+		{
+			PDepth.init(this, "shaders/vert_depth.spv", "", {&DSLGlobal}, pushConstants,
+						false, DEPTH_PREPASS);
+		}
+
+		globalDS.init(this, &DSLGlobal, {{0, UNIFORM, sizeof(GlobalUniformBufferObject), nullptr}});
+		objectUniforms.init(this, sizeof(ObjectUniformBufferObject), 64);
+		objectDS.init(this, &DSLObject, {{0, DYNAMIC_UNIFORM, sizeof(ObjectUniformBufferObject), nullptr, &objectUniforms}});
+
+		if (gpuDriven)
+		{
+			recordEveryFrame = false;
+			DSLGpu.init(this, {{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT},
+							   {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT}});
+			DSLCull.init(this, {{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+								{1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+								{2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+								{3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT}});
+			PGpu.init(this, "shaders/vert_gpu.spv", fragShader, {&DSLGpu, textureDSL});
+			PCull.init(this, "shaders/cull.spv", {&DSLCull},
+					   {{VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t)}});
+		}
+		else
+		{
+			PInst.init(this, "shaders/vert_inst.spv", fragShader, {&DSLGlobal, textureDSL},
+					   pushConstants, true);
+		}
 
 		// Load objects from file
-		Loader loader = Loader(MODEL_PATH + "DungeonEnd.diff3.obj");
-
-        // Texture loading
-		floorTexture.init(this, TEXTURE_PATH + "terra.png");
-		doorTexture.init(this, TEXTURE_PATH + "wood_door.jpg");
-		doorFlipTexture.init(this, TEXTURE_PATH + "wood_door_flip.jpg");
-		wallTexture.init(this, TEXTURE_PATH + "muro_rosso.jpg");
-		ceilingTexture.init(this, TEXTURE_PATH + "trak_tile_red.jpg");
-		copperKeyTexture.init(this, TEXTURE_PATH + "CopperKey.png");
-		goldKeyTexture.init(this, TEXTURE_PATH + "GoldKey.png");
-		leverTexture.init(this, TEXTURE_PATH + "Lever.png");
-		doorSideTexture.init(this, TEXTURE_PATH + "DoorSide2.png");
-		endTexture.init(this, TEXTURE_PATH + "end.png");
+		Loader loader(MODEL_PATH + "DungeonEnd.diff3.obj", &workers);
+		auto objectsStart = std::chrono::high_resolution_clock::now();
+
+        // Texture loading: decoded on the workers, uploaded with the geometry
+		auto texturesStart = std::chrono::high_resolution_clock::now();
+		std::vector<std::string> textureFiles;
+		for (const std::string &name : SCENE_TEXTURES)
+		{
+			textureFiles.push_back(TEXTURE_PATH + name);
+		}
+		sceneTextures = textures.acquire(textureFiles);
+		floorTexture = sceneTextures[0];
+		doorTexture = sceneTextures[1];
+		doorFlipTexture = sceneTextures[2];
+		wallTexture = sceneTextures[3];
+		ceilingTexture = sceneTextures[4];
+		copperKeyTexture = sceneTextures[5];
+		goldKeyTexture = sceneTextures[6];
+		leverTexture = sceneTextures[7];
+		doorSideTexture = sceneTextures[8];
+		endTexture = sceneTextures[9];
+		loader.printTime("textures load", texturesStart);
+
+		textureSets.resize(bindless ? 0 : sceneTextures.size());
+		for (size_t i = 0; i < textureSets.size(); i++)
+		{
+			textureSets[i].init(this, &DSLTexture, {{1, TEXTURE, 0, sceneTextures[i]}});
+		}
 
 		// Objects initialization
-		copperKey.init(this, &DSL1, loader, 0, copperKeyTexture, glm::vec3(15.0, 0.0, 3.0), glm::vec3(0.0f), 0.0f);
-		goldKey.init(this, &DSL1, loader, 1, goldKeyTexture, glm::vec3(10.0, 0.0, -8.0), glm::vec3(0.0f), 0.0f);
-		doorSide.init(this, &DSL1, loader, 2, doorSideTexture);
+		copperKey.init(this, &objectUniforms, loader, 0, copperKeyTexture, glm::vec3(15.0, 0.0, 3.0), glm::vec3(0.0f), 0.0f);
+		goldKey.init(this, &objectUniforms, loader, 1, goldKeyTexture, glm::vec3(10.0, 0.0, -8.0), glm::vec3(0.0f), 0.0f);
+		doorSide.init(this, nullptr, loader, 2, doorSideTexture);
 		
         // Key Holes
-        goldKeyHole4.init(this, &DSL1, loader, 3, goldKeyTexture, glm::vec3(11.55, 0.5, 3.95), &door4);
-		copperKeyHole2.init(this, &DSL1, loader, 4, copperKeyTexture, glm::vec3(6.95, 0.5, 8.45), &door2);
+        goldKeyHole4.init(this, &objectUniforms, loader, 3, goldKeyTexture, glm::vec3(11.55, 0.5, 3.95), &door4);
+		copperKeyHole2.init(this, &objectUniforms, loader, 4, copperKeyTexture, glm::vec3(6.95, 0.5, 8.45), &door2);
 
 		// Levers (interactable objects)
-		lever1.init(this, &DSL1, loader, 5, leverTexture, glm::vec3(3.0, 0.5, 3.5), glm::vec3(1.0f, 0.0f, 0.0f), -90.0f, &door1);
-		lever3.init(this, &DSL1, loader, 6, leverTexture, glm::vec3(9.5, 0.5, 4.0), glm::vec3(0.0f, 0.0f, 1.0f), 90.0f, &door3);
-		lever5.init(this, &DSL1, loader, 7, leverTexture, glm::vec3(4.5, 0.5, -1.0), glm::vec3(0.0f, 0.0f, 1.0f), 90.0f, &door5);
+		lever1.init(this, &objectUniforms, loader, 5, leverTexture, glm::vec3(3.0, 0.5, 3.5), glm::vec3(1.0f, 0.0f, 0.0f), -90.0f, &door1);
+		lever3.init(this, &objectUniforms, loader, 6, leverTexture, glm::vec3(9.5, 0.5, 4.0), glm::vec3(0.0f, 0.0f, 1.0f), 90.0f, &door3);
+		lever5.init(this, &objectUniforms, loader, 7, leverTexture, glm::vec3(4.5, 0.5, -1.0), glm::vec3(0.0f, 0.0f, 1.0f), 90.0f, &door5);
 
         // Doors with rotation parameters (axis and angle)
-		door5.init(this, &DSL1, loader, 8, doorFlipTexture, glm::vec3(4.4, 0.0, -2.0), glm::vec3(0.0f, 1.0f, 0.0f), -90.0f);
-		door4.init(this, &DSL1, loader, 9, doorTexture, glm::vec3(12.4, 0.0, 4.0), glm::vec3(0.0f, 1.0f, 0.0f), 90.0f);
-		door3.init(this, &DSL1, loader, 10, doorFlipTexture, glm::vec3(9.4, 0.0, 3.0), glm::vec3(0.0f, 1.0f, 0.0f), -90.0f);
-		door2.init(this, &DSL1, loader, 11, doorTexture, glm::vec3(7.0, 0.0, 7.6), glm::vec3(0.0f, 1.0f, 0.0f), 90.0f);
-		door1.init(this, &DSL1, loader, 12, doorFlipTexture, glm::vec3(4, 0, 3.4), glm::vec3(0.0f, 1.0f, 0.0f), -90.0f);
-
-		floor.init(this, &DSL1, loader, 13, floorTexture);
-		wallW.init(this, &DSL1, loader, 14, wallTexture);
-		wallE.init(this, &DSL1, loader, 15, wallTexture);
-		wallN.init(this, &DSL1, loader, 16, wallTexture);
-		wallS.init(this, &DSL1, loader, 17, wallTexture);
-		ceiling.init(this, &DSL1, loader, 18, ceilingTexture);
+		door5.init(this, &objectUniforms, loader, 8, doorFlipTexture, glm::vec3(4.4, 0.0, -2.0), glm::vec3(0.0f, 1.0f, 0.0f), -90.0f);
+		door4.init(this, &objectUniforms, loader, 9, doorTexture, glm::vec3(12.4, 0.0, 4.0), glm::vec3(0.0f, 1.0f, 0.0f), 90.0f);
+		door3.init(this, &objectUniforms, loader, 10, doorFlipTexture, glm::vec3(9.4, 0.0, 3.0), glm::vec3(0.0f, 1.0f, 0.0f), -90.0f);
+		door2.init(this, &objectUniforms, loader, 11, doorTexture, glm::vec3(7.0, 0.0, 7.6), glm::vec3(0.0f, 1.0f, 0.0f), 90.0f);
+		door1.init(this, &objectUniforms, loader, 12, doorFlipTexture, glm::vec3(4, 0, 3.4), glm::vec3(0.0f, 1.0f, 0.0f), -90.0f);
+
+		// Static objects: merged into the chunks of batchStaticObjects, drawn with P2
+		floor.init(this, nullptr, loader, 13, floorTexture);
+		wallW.init(this, nullptr, loader, 14, wallTexture);
+		wallE.init(this, nullptr, loader, 15, wallTexture);
+		wallN.init(this, nullptr, loader, 16, wallTexture);
+		wallS.init(this, nullptr, loader, 17, wallTexture);
+		ceiling.init(this, nullptr, loader, 18, ceilingTexture);
         
         // Plane with final message for victory
-		endPlane.init(this, &DSL1, loader, 19, endTexture);
-
-		allObjects.insert(allObjects.end(), {copperKey, goldKey, doorSide, goldKeyHole4, 
-		copperKeyHole2, lever1, lever3, lever5, door5, door4, door3, door2, door1, floor, wallW, wallE, wallN, wallS, ceiling, endPlane});
+		endPlane.init(this, nullptr, loader, 19, endTexture);
+		loader.printTime("objects init", objectsStart);
+
+		sceneObjects.insert(sceneObjects.end(), {&copperKey, &goldKey, &doorSide, &goldKeyHole4, 
+		&copperKeyHole2, &lever1, &lever3, &lever5, &door5, &door4, &door3, &door2, &door1, &floor, &wallW, &wallE, &wallN, &wallS, &ceiling, &endPlane});
+		// keys, key holes and levers are shiny
+		for (SceneObject *obj : std::vector<SceneObject *>{&copperKey, &goldKey, &goldKeyHole4,
+														   &copperKeyHole2, &lever1, &lever3, &lever5})
+		{
+			obj->materialFeatures = MATERIAL_SPECULAR;
+		}
+		batchStaticObjects(loader);
 
 		interactables.insert(interactables.end(), {&lever1, &lever3, &lever5});
 		keyHoles.insert(keyHoles.end(), {&goldKeyHole4, &copperKeyHole2});
+
+		if (!gpuDriven)
+		{
+			initInstanceBatches(loader);
+		}
+		uploadModels();
+		assignSortIds();
+		if (gpuDriven)
+		{
+			initGpuDriven();
+		}
+		createPipelineVariants();
+	}
+
+	// Creates every pipeline variant the objects are drawn with, so that
+	// recording only looks them up
+	void createPipelineVariants()
+	{
+		if (gpuDriven)
+		{
+			for (DrawGroup &group : drawGroups)
+			{
+				PGpu.get(group.features);
+			}
+			return;
+		}
+		for (SceneObject *obj : allObjects)
+		{
+			pipelineOf(*obj);
+		}
+		for (InstanceBatch &batch : instanceBatches)
+		{
+			PInst.get(batch.members[0]->materialFeatures);
+		}
+	}
+
+	// Variant of the pipeline that draws obj (CPU path, not instanced)
+	Pipeline &pipelineOf(const SceneObject &obj)
+	{
+		return (obj.pushConstants ? P2 : P1).get(obj.materialFeatures);
+	}
+
+	// Adds the meshes of the moving objects to the geometry buffer. The
+	// members of an instance batch draw the mesh of the first one, so only
+	// that one is uploaded and the others keep just their bounds.
+	void uploadModels()
+	{
+		for (InstanceBatch &batch : instanceBatches)
+		{
+			const Model &mesh = batch.members[0]->model;
+			batch.members[0]->model.init(this, "");
+			for (size_t i = 1; i < batch.members.size(); i++)
+			{
+				batch.members[i]->model.initShared(this, mesh);
+			}
+		}
+		for (SceneObject *obj : allObjects)
+		{
+			if (!obj->pushConstants && obj->instanceSlot < 0)
+			{
+				obj->model.init(this, "");
+			}
+		}
+	}
+
+	// Numbers the distinct textures and meshes of the drawn objects
+	void assignSortIds()
+	{
+		std::vector<VkImageView> views;
+		std::vector<uint32_t> meshes;
+		for (SceneObject *obj : allObjects)
+		{
+			auto texture = std::find(views.begin(), views.end(), obj->texture->textureImageView);
+			obj->materialId = static_cast<uint32_t>(texture - views.begin());
+			if (texture == views.end())
+			{
+				views.push_back(obj->texture->textureImageView);
+			}
+			auto mesh = std::find(meshes.begin(), meshes.end(), obj->model.firstIndex);
+			obj->meshId = static_cast<uint32_t>(mesh - meshes.begin());
+			if (mesh == meshes.end())
+			{
+				meshes.push_back(obj->model.firstIndex);
+			}
+		}
+	}
+
+	// Merges the static objects into chunks: one model for each texture and
+	// chunkSize x chunkSize region of the map, with the vertices already
+	// transformed. A triangle goes to the region of its centroid.
+	void batchStaticObjects(Loader &loader)
+	{
+		int chunksX = (mapWidth + chunkSize - 1) / chunkSize;
+		int chunksY = (mapHeight + chunkSize - 1) / chunkSize;
+		int chunksPerTexture = chunksX * chunksY;
+
+		// texture and material features of the chunks of each texture index
+		std::vector<std::pair<VkImageView, uint32_t>> materials;
+		std::unordered_map<uint32_t, size_t> chunkOfKey;
+		std::vector<SceneObject *> sources;	// an object giving the texture of each chunk
+		std::vector<Model> chunkModels;
+		int merged = 0;
+
+		for (SceneObject *obj : sceneObjects)
+		{
+			if (!obj->pushConstants)
+			{
+				allObjects.push_back(obj);
+				continue;
+			}
+			merged++;
+
+			std::pair<VkImageView, uint32_t> material(obj->texture->textureImageView, obj->materialFeatures);
+			uint32_t textureIndex = static_cast<uint32_t>(
+				std::find(materials.begin(), materials.end(), material) - materials.begin());
+			if (textureIndex == materials.size())
+			{
+				materials.push_back(material);
+			}
+
+			MeshView view = loader.shapeView(obj->shapeIndex);
+			glm::mat3 normalMatrix = glm::mat3(obj->matrix);
+			// index of each source vertex in the chunks it was copied to
+			std::unordered_map<uint64_t, uint32_t> remap;
+
+			for (uint32_t t = 0; t + 2 < view.indexCount; t += 3)
+			{
+				glm::vec3 p[3];
+				for (int k = 0; k < 3; k++)
+				{
+					p[k] = glm::vec3(obj->matrix * glm::vec4(view.vertices[view.indices[t + k]].pos, 1.0f));
+				}
+				glm::vec3 centroid = (p[0] + p[1] + p[2]) / 3.0f;
+				glm::ivec2 cell = posToMap(centroid.x, centroid.z);
+				uint32_t key = textureIndex * chunksPerTexture +
+							   (cell.y / chunkSize) * chunksX + cell.x / chunkSize;
+
+				auto found = chunkOfKey.find(key);
+				if (found == chunkOfKey.end())
+				{
+					found = chunkOfKey.emplace(key, chunkModels.size()).first;
+					chunkModels.emplace_back();
+					sources.push_back(obj);
+				}
+				size_t chunk = found->second;
+				Model &model = chunkModels[chunk];
+
+				for (int k = 0; k < 3; k++)
+				{
+					uint32_t index = view.indices[t + k];
+					uint64_t remapKey = (uint64_t)chunk << 32 | index;
+					auto copied = remap.find(remapKey);
+					if (copied == remap.end())
+					{
+						Vertex v = view.vertices[index];
+						v.pos = p[k];
+						v.norm = normalMatrix * v.norm;
+						copied = remap.emplace(remapKey, static_cast<uint32_t>(model.vertices.size())).first;
+						model.vertices.push_back(v);
+					}
+					model.indices.push_back(copied->second);
+				}
+			}
+		}
+
+		staticChunks.resize(chunkModels.size());
+		for (size_t c = 0; c < chunkModels.size(); c++)
+		{
+			SceneObject &chunk = staticChunks[c];
+			chunk.model = std::move(chunkModels[c]);
+			chunk.model.init(this, "");
+			chunk.texture = sources[c]->texture;
+			chunk.pushConstants = true;
+			chunk.materialFeatures = sources[c]->materialFeatures;
+			chunk.matrix = glm::mat4(1.0f);
+			chunk.position = glm::vec3(0.0f);
+			chunk.shapeIndex = -1;	// not built from a loader shape
+			allObjects.push_back(&chunk);
+		}
+		std::cout << "Static batching: " << merged << " objects in "
+				  << staticChunks.size() << " chunks\n";
+	}
+
+	// True when mesh b is mesh a moved by offset
+	static bool isTranslatedCopy(const MeshView &a, const MeshView &b, glm::vec3 &offset)
+	{
+		if (a.vertexCount != b.vertexCount || a.indexCount != b.indexCount || a.vertexCount == 0 ||
+			memcmp(a.indices, b.indices, a.indexCount * sizeof(uint32_t)) != 0)
+		{
+			return false;
+		}
+		const float eps = 1e-4f;
+		offset = b.vertices[0].pos - a.vertices[0].pos;
+		for (uint32_t i = 0; i < a.vertexCount; i++)
+		{
+			const Vertex &va = a.vertices[i];
+			const Vertex &vb = b.vertices[i];
+			if (glm::distance(vb.pos, va.pos + offset) > eps ||
+				glm::distance(vb.norm, va.norm) > eps ||
+				glm::distance(vb.texCoord, va.texCoord) > eps)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Batches the moving objects that are translated copies of each other
+	// with the same texture and material features. Their transforms go to per image instance buffers.
+	void initInstanceBatches(Loader &loader)
+	{
+		uint32_t instanceCount = 0;
+		for (size_t i = 0; i < allObjects.size(); i++)
+		{
+			SceneObject *base = allObjects[i];
+			if (base->pushConstants || base->instanceSlot >= 0)
+			{
+				continue;
+			}
+			MeshView baseView = loader.shapeView(base->shapeIndex);
+
+			InstanceBatch batch;
+			batch.members.push_back(base);
+			for (size_t j = i + 1; j < allObjects.size(); j++)
+			{
+				SceneObject *obj = allObjects[j];
+				glm::vec3 offset;
+				if (!obj->pushConstants && obj->instanceSlot < 0 &&
+					obj->texture->textureImageView == base->texture->textureImageView &&
+					obj->materialFeatures == base->materialFeatures &&
+					isTranslatedCopy(baseView, loader.shapeView(obj->shapeIndex), offset))
+				{
+					obj->instanceOffset = offset;
+					batch.members.push_back(obj);
+				}
+			}
+			if (batch.members.size() < 2)
+			{
+				continue;
+			}
+
+			batch.firstInstance = instanceCount;
+			std::cout << "Instance batch:";
+			for (SceneObject *obj : batch.members)
+			{
+				obj->instanceSlot = instanceCount++;
+				obj->markDirty();
+				std::cout << " " << loader.shapeView(obj->shapeIndex).name;
+			}
+			std::cout << "\n";
+			instanceBatches.push_back(std::move(batch));
+		}
+
+		if (instanceCount > 0)
+		{
+			instanceBuffers.resize(swapChainImages.size());
+			instanceBuffersMemory.resize(swapChainImages.size());
+			for (size_t i = 0; i < swapChainImages.size(); i++)
+			{
+				createBuffer(instanceCount * sizeof(InstanceData), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							 instanceBuffers[i], instanceBuffersMemory[i]);
+			}
+		}
+		std::cout << "Instancing: " << instanceCount << " objects in "
+				  << instanceBatches.size() << " batches\n";
+	}
+
+	// Groups the objects by texture (not when bindless) and material features,
+	// creates the object records and the per image command and counter
+	// buffers written by cull.comp
+	void initGpuDriven()
+	{
+		std::vector<std::pair<VkImageView, uint32_t>> groupMaterial;	// texture and features
+		std::vector<uint32_t> objectGroup(allObjects.size());
+		for (size_t i = 0; i < allObjects.size(); i++)
+		{
+			SceneObject *obj = allObjects[i];
+			VkImageView view = bindless ? VK_NULL_HANDLE : obj->texture->textureImageView;
+			std::pair<VkImageView, uint32_t> material(view, obj->materialFeatures);
+			uint32_t group = static_cast<uint32_t>(
+				std::find(groupMaterial.begin(), groupMaterial.end(), material) - groupMaterial.begin());
+			if (group == groupMaterial.size())
+			{
+				groupMaterial.push_back(material);
+				drawGroups.push_back({0, 0, obj->materialFeatures, obj->texture});
+			}
+			objectGroup[i] = group;
+			drawGroups[group].maxCount++;
+		}
+
+		uint32_t commandCount = 0;
+		for (DrawGroup &group : drawGroups)
+		{
+			group.firstCommand = commandCount;
+			commandCount += group.maxCount;
+		}
+
+		// device local, cleared and filled by the GPU every frame
+		VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+								   VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+								   VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		indirectBuffers.resize(swapChainImages.size());
+		indirectBuffersMemory.resize(swapChainImages.size());
+		countBuffers.resize(swapChainImages.size());
+		countBuffersMemory.resize(swapChainImages.size());
+		for (size_t i = 0; i < swapChainImages.size(); i++)
+		{
+			createBuffer(commandCount * sizeof(VkDrawIndexedIndirectCommand), usage,
+						 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						 indirectBuffers[i], indirectBuffersMemory[i]);
+			createBuffer(drawGroups.size() * sizeof(uint32_t), usage,
+						 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						 countBuffers[i], countBuffersMemory[i]);
+		}
+
+		int recordsSize = static_cast<int>(allObjects.size() * sizeof(ObjectRecord));
+		gpuDS.init(this, &DSLGpu, {{0, UNIFORM, sizeof(GlobalUniformBufferObject), nullptr, nullptr, &globalDS.uniformBuffers[0]},
+								   {1, STORAGE, recordsSize, nullptr}});
+		cullDS.init(this, &DSLCull, {{0, UNIFORM, sizeof(GlobalUniformBufferObject), nullptr, nullptr, &globalDS.uniformBuffers[0]},
+									 {1, STORAGE, recordsSize, nullptr, nullptr, &gpuDS.uniformBuffers[1]},
+									 {2, STORAGE, 0, nullptr, nullptr, &indirectBuffers},
+									 {3, STORAGE, 0, nullptr, nullptr, &countBuffers}});
+
+		// static objects are written here once, the others when they change
+		for (size_t i = 0; i < allObjects.size(); i++)
+		{
+			SceneObject &obj = *allObjects[i];
+			obj.recordIndex = static_cast<uint32_t>(i);
+			for (size_t image = 0; image < swapChainImages.size(); image++)
+			{
+				ObjectRecord &record =
+					static_cast<ObjectRecord *>(gpuDS.uniformData(1, image))[i];
+				record.model = obj.matrix;
+				record.bbMin = glm::vec4(obj.model.bbMin, 1.0f);
+				record.bbMax = glm::vec4(obj.model.bbMax, 1.0f);
+				record.firstIndex = obj.model.firstIndex;
+				record.indexCount = obj.model.indexCount;
+				record.vertexOffset = obj.model.vertexOffset;
+				record.group = objectGroup[i];
+				record.firstCommand = drawGroups[objectGroup[i]].firstCommand;
+				record.textureIndex = obj.texture->bindlessIndex;
+			}
+		}
+		std::cout << "GPU driven: " << allObjects.size() << " objects in "
+				  << drawGroups.size() << " draw groups\n";
 	}
 
 	// Destroy all the objects created before closing
 	void localCleanup()
 	{
-		for (SceneObject obj : allObjects)
+		for (SceneObject *obj : sceneObjects)
+		{
+			obj->cleanup();
+		}
+		for (DescriptorSet &textureSet : textureSets)
+		{
+			textureSet.cleanup();
+		}
+		for (Texture *texture : sceneTextures)
+		{
+			textures.release(texture);
+		}
+		for (SceneObject &chunk : staticChunks)
 		{
-			obj.cleanup();
+			chunk.model.cleanup();
 		}
+		if (gpuDriven)
+		{
+			for (size_t i = 0; i < indirectBuffers.size(); i++)
+			{
+				vkDestroyBuffer(device, indirectBuffers[i], nullptr);
+				allocator.free(indirectBuffersMemory[i]);
+				vkDestroyBuffer(device, countBuffers[i], nullptr);
+				allocator.free(countBuffersMemory[i]);
+			}
+			cullDS.cleanup();
+			gpuDS.cleanup();
+			PCull.cleanup();
+			PGpu.cleanup();
+			DSLCull.cleanup();
+			DSLGpu.cleanup();
+		}
+		else
+		{
+			for (size_t i = 0; i < instanceBuffers.size(); i++)
+			{
+				vkDestroyBuffer(device, instanceBuffers[i], nullptr);
+				allocator.free(instanceBuffersMemory[i]);
+			}
+			PInst.cleanup();
+		}
+		globalDS.cleanup();
+		objectDS.cleanup();
+		objectUniforms.cleanup();
 		P1.cleanup();
-		DSL1.cleanup();
+		P2.cleanup();
+		if (depthPrepass)
+		{
+			PDepth.cleanup();
+		}
+		DSLObject.cleanup();
+		DSLTexture.cleanup();
+		DSLGlobal.cleanup();
 	}
 
-	void SendToCommandBuffer(VkCommandBuffer &commandBuffer, int currentImage, SceneObject &obj)
+	// boundSet is the texture set currently bound, it is skipped when it is the same
+	void SendToCommandBuffer(VkCommandBuffer &commandBuffer, int currentImage, SceneObject &obj,
+							 VkDescriptorSet &boundSet)
 	{
-		VkBuffer vertexBuffers[] = {obj.model.vertexBuffer};
-		// property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
-		VkDeviceSize offsets[] = {0};
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		// property .indexBuffer of models, contains the VkBuffer handle to its index buffer
-		vkCmdBindIndexBuffer(commandBuffer, obj.model.indexBuffer, 0,
-							 VK_INDEX_TYPE_UINT32);
-
 		// property .pipelineLayout of a pipeline contains its layout.
 		// property .descriptorSets of a descriptor set contains its elements.
+		VkPipelineLayout layout = pipelineOf(obj).pipelineLayout;
+		bindTexture(commandBuffer, currentImage, layout, obj.texture, boundSet);
+		if (obj.pushConstants)
+		{
+			PushConstantObject pc{obj.matrix, obj.texture->bindlessIndex};
+			vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT,
+							   0, sizeof(pc), &pc);
+		}
+		else
+		{
+			uint32_t textureIndex = obj.texture->bindlessIndex;
+			vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT,
+							   offsetof(PushConstantObject, textureIndex), sizeof(textureIndex),
+							   &textureIndex);
+			// The dynamic offset selects the object's slot in this image's region.
+			uint32_t dynamicOffset = objectUniforms.offset(currentImage, obj.uniformSlot);
+			vkCmdBindDescriptorSets(commandBuffer,
+									VK_PIPELINE_BIND_POINT_GRAPHICS,
+									layout, 2, 1, &objectDS.descriptorSets[currentImage],
+									1, &dynamicOffset);
+		}
+
+		// the model is a range of the shared geometry buffers, bound once per frame
+		vkCmdDrawIndexed(commandBuffer, obj.model.indexCount, 1,
+						 obj.model.firstIndex, obj.model.vertexOffset, 0);
+	}
+
+	// Set of texture, for the draws without bindless textures
+	DescriptorSet &textureSet(const Texture *texture)
+	{
+		size_t i = std::find(sceneTextures.begin(), sceneTextures.end(), texture) - sceneTextures.begin();
+		return textureSets[i];
+	}
+
+	// Binds the set of texture as set 1, unless it is boundSet already.
+	// Nothing to do with bindless textures: bindFrameSets bound the table.
+	void bindTexture(VkCommandBuffer commandBuffer, int currentImage, VkPipelineLayout layout,
+					 const Texture *texture, VkDescriptorSet &boundSet)
+	{
+		if (bindless)
+		{
+			return;
+		}
+		VkDescriptorSet set = textureSet(texture).descriptorSets[currentImage];
+		if (set != boundSet)
+		{
+			vkCmdBindDescriptorSets(commandBuffer,
+									VK_PIPELINE_BIND_POINT_GRAPHICS,
+									layout, 1, 1, &set,
+									0, nullptr);
+			boundSet = set;
+		}
+	}
+
+	// Binds the per frame uniforms (set 0) and, with bindless textures, the
+	// texture table (set 1). The layouts of the CPU path agree on these sets
+	// and on the push constants, so they stay bound for the whole command
+	// buffer when the pipeline changes.
+	void bindFrameSets(VkCommandBuffer commandBuffer, int currentImage, VkPipelineLayout layout)
+	{
+		VkDescriptorSet sets[] = {globalDS.descriptorSets[currentImage],
+								  bindless ? textureTable.descriptorSets[currentImage] : VK_NULL_HANDLE};
 		vkCmdBindDescriptorSets(commandBuffer,
 								VK_PIPELINE_BIND_POINT_GRAPHICS,
-								P1.pipelineLayout, 0, 1, &obj.DS.descriptorSets[currentImage],
+								layout, 0, bindless ? 2 : 1, sets,
 								0, nullptr);
-
-		// property .indices.size() of models, contains the number of triangles * 3 of the mesh.
-		vkCmdDrawIndexed(commandBuffer,
-						 static_cast<uint32_t>(obj.model.indices.size()), 1, 0, 0, 0);
 	}
 
 	// Here it is the creation of the command buffer:
@@ -364,16 +1092,257 @@ protected:
 	// with their buffers and textures
 	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage)
 	{
+		if (gpuDriven)
+		{
+			recordIndirectDraws(commandBuffer, currentImage);
+			return;
+		}
+		recordObjects(commandBuffer, currentImage, 0, allObjects.size());
+	}
+
+	// The static objects drawn by P2, front to back, with positions only.
+	// P2 tests EQUAL against this depth, so both draw the same visible set.
+	// Only on the CPU path: the GPU driven one computes its positions in
+	// another shader and could not match them exactly.
+	void populateDepthPrepass(VkCommandBuffer commandBuffer, int currentImage)
+	{
+		RenderQueue queue;
+		for (size_t i = 0; i < allObjects.size(); i++)
+		{
+			if (allObjects[i]->pushConstants && isVisible(*allObjects[i]))
+			{
+				queue.push(sortKey(*allObjects[i], 0), static_cast<uint32_t>(i));
+			}
+		}
+		queue.sort();
 
+		geometry.bindPositions(commandBuffer);
 		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-						  P1.graphicsPipeline);
+						  PDepth.graphicsPipeline);
+		vkCmdBindDescriptorSets(commandBuffer,
+								VK_PIPELINE_BIND_POINT_GRAPHICS,
+								PDepth.pipelineLayout, 0, 1, &globalDS.descriptorSets[currentImage],
+								0, nullptr);
+		for (uint32_t item : queue.items)
+		{
+			SceneObject &obj = *allObjects[item];
+			PushConstantObject pc{obj.matrix};
+			vkCmdPushConstants(commandBuffer, PDepth.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
+							   0, sizeof(pc), &pc);
+			vkCmdDrawIndexed(commandBuffer, obj.model.indexCount, 1,
+							 obj.model.firstIndex, obj.model.vertexOffset, 0);
+		}
+	}
+
+	// Clears the commands and counters, then cull.comp fills them for this image
+	void populateComputeCommands(VkCommandBuffer commandBuffer, int currentImage)
+	{
+		if (!gpuDriven)
+		{
+			return;
+		}
+
+		vkCmdFillBuffer(commandBuffer, indirectBuffers[currentImage], 0, VK_WHOLE_SIZE, 0);
+		vkCmdFillBuffer(commandBuffer, countBuffers[currentImage], 0, VK_WHOLE_SIZE, 0);
+
+		VkMemoryBarrier clearBarrier{};
+		clearBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		clearBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+							 1, &clearBarrier, 0, nullptr, 0, nullptr);
+
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, PCull.computePipeline);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+								PCull.pipelineLayout, 0, 1, &cullDS.descriptorSets[currentImage],
+								0, nullptr);
+		uint32_t objectCount = static_cast<uint32_t>(allObjects.size());
+		vkCmdPushConstants(commandBuffer, PCull.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+						   0, sizeof(objectCount), &objectCount);
+		// 64 objects per work group, as local_size_x in cull.comp
+		vkCmdDispatch(commandBuffer, (objectCount + 63) / 64, 1, 1);
+
+		VkMemoryBarrier cullBarrier{};
+		cullBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		cullBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		cullBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+							 VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+							 1, &cullBarrier, 0, nullptr, 0, nullptr);
+	}
+
+	// One indirect draw per group, the model matrix (and the texture index
+	// when bindless) is read from the object record selected by firstInstance
+	void recordIndirectDraws(VkCommandBuffer commandBuffer, int currentImage)
+	{
+		geometry.bind(commandBuffer);
+
+		const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+		Pipeline *boundPipeline = nullptr;
+		for (size_t g = 0; g < drawGroups.size(); g++)
+		{
+			Pipeline &P = PGpu.get(drawGroups[g].features);
+			if (&P != boundPipeline)
+			{
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+								  P.graphicsPipeline);
+				VkDescriptorSet sets[] = {gpuDS.descriptorSets[currentImage],
+										  textureTable.descriptorSets[currentImage]};
+				vkCmdBindDescriptorSets(commandBuffer,
+										VK_PIPELINE_BIND_POINT_GRAPHICS,
+										P.pipelineLayout, 0, bindless ? 2 : 1, sets,
+										0, nullptr);
+				boundPipeline = &P;
+			}
+			if (!bindless)
+			{
+				vkCmdBindDescriptorSets(commandBuffer,
+										VK_PIPELINE_BIND_POINT_GRAPHICS,
+										P.pipelineLayout, 1, 1,
+										&textureSet(drawGroups[g].texture).descriptorSets[currentImage],
+										0, nullptr);
+			}
+			drawIndexedIndirect(commandBuffer, indirectBuffers[currentImage],
+								drawGroups[g].firstCommand * stride,
+								countBuffers[currentImage], g * sizeof(uint32_t),
+								drawGroups[g].maxCount, stride);
+		}
+	}
+
+	// Each part records a contiguous range of allObjects. A secondary command
+	// buffer inherits no state, so every part binds geometry and pipelines.
+	void populateCommandBufferPart(VkCommandBuffer commandBuffer, int currentImage,
+								   int part, int partCount)
+	{
+		if (gpuDriven)
+		{
+			if (part == 0)
+			{
+				populateCommandBuffer(commandBuffer, currentImage);
+			}
+			return;
+		}
+
+		size_t first = allObjects.size() * part / partCount;
+		size_t last = allObjects.size() * (part + 1) / partCount;
+		if (first < last)
+		{
+			recordObjects(commandBuffer, currentImage, first, last);
+		}
+	}
+
+	// The visible objects in [first, last) and, in the first part, the instance
+	// batches go through a render queue: sorted by pipeline variant, texture,
+	// mesh and then front to back. Pipelines and sets are bound only when they change.
+	void recordObjects(VkCommandBuffer commandBuffer, int currentImage, size_t first, size_t last)
+	{
+		enum { OBJECT_PIPELINE, STATIC_PIPELINE, INSTANCE_PIPELINE };
+		uint32_t batchItems = static_cast<uint32_t>(allObjects.size());
+
+		RenderQueue queue;
+		for (size_t i = first; i < last; i++)
+		{
+			SceneObject *obj = allObjects[i];
+			if (obj->instanceSlot < 0 && isVisible(*obj))
+			{
+				queue.push(sortKey(*obj, obj->pushConstants ? STATIC_PIPELINE : OBJECT_PIPELINE),
+						   static_cast<uint32_t>(i));
+			}
+		}
+		// the batches are few, the first part records all of them.
+		// A batch is culled only when all its members are outside.
+		for (size_t b = 0; first == 0 && b < instanceBatches.size(); b++)
+		{
+			for (SceneObject *obj : instanceBatches[b].members)
+			{
+				if (isVisible(*obj))
+				{
+					queue.push(sortKey(*obj, INSTANCE_PIPELINE),
+							   batchItems + static_cast<uint32_t>(b));
+					break;
+				}
+			}
+		}
+		queue.sort();
 
-		for (SceneObject obj : allObjects)
+		geometry.bind(commandBuffer);
+		Pipeline *boundPipeline = nullptr;
+		VkDescriptorSet boundSet = VK_NULL_HANDLE;
+		for (uint32_t item : queue.items)
 		{
-			SendToCommandBuffer(commandBuffer, currentImage, obj);
+			bool batchItem = item >= batchItems;
+			Pipeline *P = batchItem ?
+				&PInst.get(instanceBatches[item - batchItems].members[0]->materialFeatures) :
+				&pipelineOf(*allObjects[item]);
+			if (P != boundPipeline)
+			{
+				if (boundPipeline == nullptr)
+				{
+					bindFrameSets(commandBuffer, currentImage, P->pipelineLayout);
+				}
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+								  P->graphicsPipeline);
+				if (batchItem)
+				{
+					VkDeviceSize offset = 0;
+					vkCmdBindVertexBuffers(commandBuffer, 1, 1, &instanceBuffers[currentImage], &offset);
+				}
+				boundPipeline = P;
+			}
+
+			if (item < batchItems)
+			{
+				SendToCommandBuffer(commandBuffer, currentImage, *allObjects[item], boundSet);
+				continue;
+			}
+
+			// one draw per batch, the transforms come from the instance buffer
+			InstanceBatch &batch = instanceBatches[item - batchItems];
+			bindTexture(commandBuffer, currentImage, P->pipelineLayout, batch.members[0]->texture, boundSet);
+			const Model &mesh = batch.members[0]->model;
+			vkCmdDrawIndexed(commandBuffer, mesh.indexCount,
+							 static_cast<uint32_t>(batch.members.size()),
+							 mesh.firstIndex, mesh.vertexOffset, batch.firstInstance);
 		}
 	}
 
+	// Asks each texture for the detail of the largest visible object using
+	// it: the projected diameter of its bounding sphere, in pixels
+	void requestTextureLevels(const glm::mat4 &proj)
+	{
+		float pixelsPerUnit = 0.5f * swapChainExtent.height * std::abs(proj[1][1]);
+		for (SceneObject *obj : allObjects)
+		{
+			if (!frustum.intersects(obj->model.bbMin, obj->model.bbMax, obj->matrix))
+			{
+				continue;
+			}
+			glm::vec3 center = glm::vec3(obj->matrix * glm::vec4((obj->model.bbMin + obj->model.bbMax) * 0.5f, 1.0f));
+			float radius = glm::length(glm::vec3(obj->matrix * glm::vec4((obj->model.bbMax - obj->model.bbMin) * 0.5f, 0.0f)));
+			float distance = std::max(glm::distance(CamPos, center) - radius, 0.1f);
+			obj->texture->request(2.0f * radius * pixelsPerUnit / distance);
+		}
+	}
+
+	// Each pipeline has a key for each variant. Depth is the camera distance
+	// of the bounding box center.
+	uint64_t sortKey(const SceneObject &obj, uint32_t pipeline)
+	{
+		glm::vec3 center = glm::vec3(obj.matrix * glm::vec4((obj.model.bbMin + obj.model.bbMax) * 0.5f, 1.0f));
+		uint32_t variant = pipeline << MATERIAL_FEATURE_COUNT | obj.materialFeatures;
+		return RenderQueue::makeKey(variant, obj.materialId, obj.meshId,
+									glm::distance(CamPos, center), farPlane);
+	}
+
+	// Objects are culled only when the command buffer is recorded every frame,
+	// otherwise the draws must stay valid for any camera
+	bool isVisible(SceneObject &obj)
+	{
+		return !recordEveryFrame ||
+			   frustum.intersects(obj.model.bbMin, obj.model.bbMax, obj.matrix);
+	}
+
 	// Conversion from 3D coordinates to map coordinates
 	glm::ivec2 posToMap(float x, float y) {
 		// (9, 6) is the initial position of the player in the map
@@ -521,6 +1490,8 @@ protected:
 						glm::ivec2 mapPos = posToMap(obj->activate->position.x, obj->activate->position.z);
 						map[mapPos.y][mapPos.x] = 'd';
 					}
+					obj->markDirty();
+					obj->activate->markDirty();
 				}
 			}
             
@@ -568,6 +1539,8 @@ protected:
 						glm::ivec2 mapPos = posToMap(obj->activate->position.x, obj->activate->position.z);
 						map[mapPos.y][mapPos.x] = 'd';
 					}
+					obj->markDirty();
+					obj->activate->markDirty();
 				}
 			}
 
@@ -617,19 +1590,22 @@ protected:
 		checkKeyHoles();
 		checkKeys();
 
-		UniformBufferObject ubo{};
-
-		void *data;
+		GlobalUniformBufferObject ubo{};
 
-		ubo.view = CameraMovement(time);
+		glm::mat4 view = CameraMovement(time);
 
-		ubo.proj = glm::perspective(glm::radians(45.0f),
-									swapChainExtent.width / (float)swapChainExtent.height,
-									0.1f, 10.0f);
-		ubo.proj[1][1] *= -1;
+		glm::mat4 proj = glm::perspective(glm::radians(45.0f),
+										  swapChainExtent.width / (float)swapChainExtent.height,
+										  0.1f, farPlane);
+		proj[1][1] *= -1;
 
+		// multiplied once here instead of for every vertex
+		ubo.viewProj = proj * view;
 		ubo.eyePos = CamPos;
 		ubo.lightDir = torchLightDir;
+		memcpy(globalDS.uniformData(0, currentImage), &ubo, sizeof(ubo));
+		frustum.extract(ubo.viewProj);
+		requestTextureLevels(proj);
 
         // When key are collected, show them in the bottom right corner of the screen as inventary
 		// CopperKey
@@ -654,11 +1630,12 @@ protected:
 			glm::mat4 S1 = glm::scale(glm::mat4(1), glm::vec3(0.08f));
 
 			copperKey.matrix = T1 * Torigin * R3 * R1 * R2 * S1 * glm::inverse(Torigin);
+			copperKey.markDirty();
 
 		}
         // update object position
-		updateObjectUniform(ubo, currentImage, &data, copperKey, glm::mat4(1.0f), 1.0f);
-		updateObjectUniform(ubo, currentImage, &data, copperKeyHole2, glm::mat4(1.0f), 1.0f);
+		updateObjectUniform(currentImage, copperKey, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, copperKeyHole2, glm::mat4(1.0f));
 
 		// GoldKey
 		if (goldKeyHole4.hasKey)
@@ -682,61 +1659,58 @@ protected:
 			glm::mat4 S1 = glm::scale(glm::mat4(1), glm::vec3(0.08f));
 
 			goldKey.matrix = T1 * Torigin * R3 * R1 * R2 * S1 * glm::inverse(Torigin);
+			goldKey.markDirty();
 
 		}
-		updateObjectUniform(ubo, currentImage, &data, goldKey, glm::mat4(1.0f), 1.0f);
-		updateObjectUniform(ubo, currentImage, &data, goldKeyHole4, glm::mat4(1.0f), 1.0f);
+		updateObjectUniform(currentImage, goldKey, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, goldKeyHole4, glm::mat4(1.0f));
 
 		// Levers
-		updateObjectUniform(ubo, currentImage, &data, lever1, glm::mat4(1.0f), 1.0f);
-		updateObjectUniform(ubo, currentImage, &data, lever3, glm::mat4(1.0f), 1.0f);
-		updateObjectUniform(ubo, currentImage, &data, lever5, glm::mat4(1.0f), 1.0f);
+		updateObjectUniform(currentImage, lever1, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, lever3, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, lever5, glm::mat4(1.0f));
 
 		// Doors
-		updateObjectUniform(ubo, currentImage, &data, doorSide, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, door5, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, door4, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, door3, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, door2, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, door1, glm::mat4(1.0f));
-
-		// Floor
-		updateObjectUniform(ubo, currentImage, &data, floor, glm::mat4(1.0f));
-		
-		// Walls
-		updateObjectUniform(ubo, currentImage, &data, wallW, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, wallE, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, wallN, glm::mat4(1.0f));
-		updateObjectUniform(ubo, currentImage, &data, wallS, glm::mat4(1.0f));
-
-		// Ceiling
-		updateObjectUniform(ubo, currentImage, &data, ceiling, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, door5, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, door4, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, door3, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, door2, glm::mat4(1.0f));
+		updateObjectUniform(currentImage, door1, glm::mat4(1.0f));
 
-		// End Plane
-		updateObjectUniform(ubo, currentImage, &data, endPlane, glm::mat4(1.0f));
-	}
-
-	void updateObjectUniform(UniformBufferObject &ubo, uint32_t currentImage, void **data, SceneObject &obj, glm::mat4 modelMatrix) {
-		ubo.model = obj.matrix;
-		ubo.refl = glm::vec3(0.0f);
+		// Floor, walls, ceiling, door side and end plane are static:
+		// their model matrix is a push constant recorded in the command buffer
 
-		// Here is where you actually update your uniforms
-		vkMapMemory(device, obj.DS.uniformBuffersMemory[0][currentImage], 0,
-					sizeof(ubo), 0, data);
-		memcpy(*data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, obj.DS.uniformBuffersMemory[0][currentImage]);
 	}
 
-	void updateObjectUniform(UniformBufferObject &ubo, uint32_t currentImage, void **data, SceneObject &obj, glm::mat4 modelMatrix, float refl) {
-		ubo.model = obj.matrix;
-		ubo.refl = glm::vec3(refl);
-		//std::cout << "REFL " << refl << std::endl;
+	// Only objects marked dirty since this image was last drawn are written
+	void updateObjectUniform(uint32_t currentImage, SceneObject &obj, glm::mat4 modelMatrix) {
+		uint32_t imageBit = 1u << currentImage;
+		if ((obj.staleImages & imageBit) == 0)
+		{
+			return;
+		}
 
-		// Here is where you actually update your uniforms
-		vkMapMemory(device, obj.DS.uniformBuffersMemory[0][currentImage], 0,
-					sizeof(ubo), 0, data);
-		memcpy(*data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, obj.DS.uniformBuffersMemory[0][currentImage]);
+		if (obj.instanceSlot >= 0)
+		{
+			InstanceData *instances =
+				reinterpret_cast<InstanceData *>(instanceBuffersMemory[currentImage].mapped);
+			instances[obj.instanceSlot].model = obj.matrix * glm::translate(glm::mat4(1.0f), obj.instanceOffset);
+			instances[obj.instanceSlot].textureIndex = obj.texture->bindlessIndex;
+		}
+		else if (gpuDriven)
+		{
+			ObjectRecord &record =
+				static_cast<ObjectRecord *>(gpuDS.uniformData(1, currentImage))[obj.recordIndex];
+			record.model = obj.matrix;
+		}
+		else
+		{
+			ObjectUniformBufferObject *ubo =
+				static_cast<ObjectUniformBufferObject *>(objectUniforms.slot(obj.uniformSlot));
+			ubo->model = obj.matrix;
+			objectUniforms.upload(currentImage, obj.uniformSlot);
+		}
+		obj.staleImages &= ~imageBit;
 	}
 };
 
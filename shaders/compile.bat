@@ -1,2 +1,8 @@
 C:\VulkanSDK\1.2.198.1\Bin\glslc.exe shader.vert -o vert.spv
-C:\VulkanSDK\1.2.198.1\Bin\glslc.exe shader.frag -o frag.spv
\ No newline at end of file
+C:\VulkanSDK\1.2.198.1\Bin\glslc.exe shader.frag -o frag.spv
+C:\VulkanSDK\1.2.198.1\Bin\glslc.exe shader_pc.vert -o vert_pc.spv
+C:\VulkanSDK\1.2.198.1\Bin\glslc.exe shader_gpu.vert -o vert_gpu.spv
+C:\VulkanSDK\1.2.198.1\Bin\glslc.exe cull.comp -o cull.spv
+C:\VulkanSDK\1.2.198.1\Bin\glslc.exe shader_inst.vert -o vert_inst.spv
+C:\VulkanSDK\1.2.198.1\Bin\glslc.exe shader_depth.vert -o vert_depth.spv
+C:\VulkanSDK\1.2.198.1\Bin\glslc.exe -DBINDLESS shader.frag -o frag_bindless.spv
\ No newline at end of file
@@ -0,0 +1,22 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform GlobalUniformBufferObject {
+	mat4 viewProj;	// proj * view, computed once per frame
+	vec3 eyePos;
+	vec3 lightDir;
+} gubo;
+
+// same data as shader_pc.vert
+layout(push_constant) uniform PushConstantObject {
+	mat4 model;
+} pc;
+
+layout(location = 0) in vec3 pos;
+
+// computed exactly as in shader_pc.vert, which tests EQUAL against it
+invariant gl_Position;
+
+void main() {
+	vec4 worldPos = pc.model * vec4(pos, 1.0);
+	gl_Position = gubo.viewProj * worldPos;
+}
\ No newline at end of file
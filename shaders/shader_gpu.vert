@@ -0,0 +1,43 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform GlobalUniformBufferObject {
+	mat4 viewProj;	// proj * view, computed once per frame
+	vec3 eyePos;
+	vec3 lightDir;
+} gubo;
+
+struct ObjectRecord {
+	mat4 model;
+	vec4 bbMin;
+	vec4 bbMax;
+	uint firstIndex;
+	uint indexCount;
+	int vertexOffset;
+	uint group;
+	uint firstCommand;
+	uint textureIndex;	// in the bindless texture array
+};
+
+// firstInstance of each indirect command is the index of its object
+layout(std430, set = 0, binding = 1) readonly buffer ObjectRecords {
+	ObjectRecord objects[];
+};
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+layout(location = 0) out vec3 fragNorm;
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) out vec3 fragPos;
+layout(location = 3) flat out uint fragTextureIndex;
+
+void main() {
+	ObjectRecord obj = objects[gl_InstanceIndex];
+	vec4 worldPos = obj.model * vec4(pos, 1.0);
+	gl_Position = gubo.viewProj * worldPos;
+	fragPos = worldPos.xyz;
+	fragNorm     = (obj.model * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+	fragTextureIndex = obj.textureIndex;
+}
\ No newline at end of file
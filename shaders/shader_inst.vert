@@ -0,0 +1,28 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform GlobalUniformBufferObject {
+	mat4 viewProj;	// proj * view, computed once per frame
+	vec3 eyePos;
+	vec3 lightDir;
+} gubo;
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+// per instance (binding 1)
+layout(location = 3) in mat4 instModel;
+layout(location = 7) in uint instTextureIndex;	// in the bindless texture array
+
+layout(location = 0) out vec3 fragNorm;
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) out vec3 fragPos;
+layout(location = 3) flat out uint fragTextureIndex;
+
+void main() {
+	vec4 worldPos = instModel * vec4(pos, 1.0);
+	gl_Position = gubo.viewProj * worldPos;
+	fragPos = worldPos.xyz;
+	fragNorm     = (instModel * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+	fragTextureIndex = instTextureIndex;
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform GlobalUniformBufferObject {
+	mat4 viewProj;	// proj * view, computed once per frame
+	vec3 eyePos;
+	vec3 lightDir;
+} gubo;
+
+// per object data of static objects
+layout(push_constant) uniform PushConstantObject {
+	mat4 model;
+	uint textureIndex;	// in the bindless texture array
+} pc;
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+layout(location = 0) out vec3 fragNorm;
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) out vec3 fragPos;
+layout(location = 3) flat out uint fragTextureIndex;
+
+// must match shader_depth.vert: static objects are tested EQUAL to the prepass
+invariant gl_Position;
+
+void main() {
+	vec4 worldPos = pc.model * vec4(pos, 1.0);
+	gl_Position = gubo.viewProj * worldPos;
+	fragPos = worldPos.xyz;
+	fragNorm     = (pc.model * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+	fragTextureIndex = pc.textureIndex;
+}
\ No newline at end of file